@@ -0,0 +1,344 @@
+// Micro-benchmarks for the NMEA generation hot path
+// build with cmake (target gps_quadrino_bench) and run: ./gps_quadrino_bench [-n records] [-r rounds] [-m]
+//
+// Each benchmark runs over a table of synthetic GPS records covering the full latitude/longitude and
+// week/time-of-week ranges. Use -m for machine readable (CSV) output when comparing builds. The gpscore_* cases
+// cover the read pipeline shared by the kernel driver and the i2c-dev daemon.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "nmea.h"
+#include "gpscore.h"
+
+#define DEFAULT_RECORDS  2000000
+#define DEFAULT_ROUNDS   3
+
+typedef struct {
+    STATUS_REGISTER status;
+    GPS_COORDINATES location;
+    GPS_DETAIL detail;
+} gpsdata;
+
+typedef struct {
+    const char* name;
+    unsigned long ops;
+    unsigned long long bytes;       // bytes produced, zero if the benchmark doesnt produce output
+    int sentences;                  // non-zero if each op produces one sentence
+    double seconds;
+} bench_result;
+
+static gpsdata* records;
+static unsigned long nrecords;
+
+// sentences without checksum for the checksum benchmark, each slot is NMEA_SLOT bytes
+#define NMEA_SLOT 96
+static char* bodies;
+static int* body_lengths;
+
+// keeps the compiler from discarding the work
+static volatile unsigned long sink;
+
+/// \brief Converts seconds since epoch to broken out date/time components
+/// The kernel contains this function but it is not available in user-space. Unlike the test app we use UTC so the
+/// benchmark doesnt depend on the timezone database.
+void time_to_tm(time_t totalsecs, int offset, struct tm *result)
+{
+    totalsecs += offset;
+    gmtime_r(&totalsecs, result);
+}
+
+static uint32_t xorshift32(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void generate_records(unsigned long n)
+{
+    uint32_t seed = 0x51a7e5u;
+    unsigned long i;
+    uint8_t st;
+
+    records = (gpsdata*)malloc(n * sizeof(gpsdata));
+    if(records == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for(i=0; i<n; i++) {
+        st = (uint8_t)xorshift32(&seed);
+        memcpy(&records[i].status, &st, 1);
+        records[i].location.lat = (int32_t)(xorshift32(&seed) % 1800000001u) - 900000000;
+        records[i].location.lon = (int32_t)(xorshift32(&seed) % 3600000001u) - 1800000000;
+        records[i].detail.ground_speed = (uint16_t)xorshift32(&seed);
+        records[i].detail.altitude = (uint16_t)xorshift32(&seed);
+        records[i].detail.ground_course = (uint16_t)(xorshift32(&seed) % 3600);
+        records[i].detail.week = (uint16_t)xorshift32(&seed);
+        records[i].detail.time = xorshift32(&seed) % (7*8640000u);
+    }
+    nrecords = n;
+}
+
+static void generate_bodies(void)
+{
+    unsigned long i;
+    char* p;
+    int len;
+
+    bodies = (char*)malloc(nrecords * NMEA_SLOT);
+    body_lengths = (int*)malloc(nrecords * sizeof(int));
+    if(bodies == NULL || body_lengths == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for(i=0; i<nrecords; i++) {
+        p = bodies + i*NMEA_SLOT;
+        len = nmea_gga(p, NMEA_SLOT, &records[i].status, &records[i].location, &records[i].detail);
+        // strip the checksum, the benchmark puts it back
+        body_lengths[i] = (len > 4) ? len - 4 : 0;
+        p[body_lengths[i]] = 0;
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_checksum(bench_result* r)
+{
+    unsigned long i, sum = 0;
+    int len;
+    char* p;
+    for(i=0; i<nrecords; i++) {
+        p = bodies + i*NMEA_SLOT;
+        p[body_lengths[i]] = 0;
+        sum += nmea_checksum(p, &len, 1);
+        r->bytes += len;
+    }
+    sink += sum;
+}
+
+static void bench_degrees2dms(bench_result* r)
+{
+    unsigned long i, sum = 0;
+    geodms dms;
+    for(i=0; i<nrecords; i++) {
+        degrees2dms(records[i].location.lat, &dms);
+        sum += dms.fraction;
+        degrees2dms(records[i].location.lon, &dms);
+        sum += dms.fraction;
+    }
+    r->ops = nrecords * 2;
+    sink += sum;
+}
+
+static void bench_time2tm(bench_result* r)
+{
+    unsigned long i, sum = 0;
+    struct tm broken;
+    for(i=0; i<nrecords; i++) {
+        gps_time2tm(&records[i].detail, &broken);
+        sum += broken.tm_sec;
+    }
+    sink += sum;
+}
+
+static void bench_clock(bench_result* r)
+{
+    unsigned long i, sum = 0;
+    struct tm broken;
+    gpsclock clock;
+    GPS_DETAIL detail = records[0].detail;
+
+    // a real receiver produces a steady stream of fixes, model it at 10Hz
+    gps_clock_init(&clock, 18);
+    for(i=0; i<nrecords; i++) {
+        detail.time += 10;
+        if(detail.time >= 7*8640000u) {
+            detail.time = 0;
+            detail.week++;
+        }
+        gps_clock_convert(&clock, &detail, &broken);
+        sum += broken.tm_sec;
+    }
+    sink += sum;
+}
+
+static void bench_gga(bench_result* r)
+{
+    unsigned long i;
+    char sout[NMEA_SLOT];
+    int len;
+    for(i=0; i<nrecords; i++) {
+        len = nmea_gga(sout, sizeof(sout), &records[i].status, &records[i].location, &records[i].detail);
+        if(len > 0)
+            r->bytes += len;
+    }
+    sink += sout[7];
+}
+
+static void bench_zda(bench_result* r)
+{
+    unsigned long i;
+    char sout[NMEA_SLOT];
+    int len;
+    for(i=0; i<nrecords; i++) {
+        len = nmea_zda(sout, sizeof(sout), &records[i].detail);
+        if(len > 0)
+            r->bytes += len;
+    }
+    sink += sout[7];
+}
+
+// decode, dedupe and format a register image per op, as a poll cycle does after the burst read
+static void bench_pipeline(bench_result* r)
+{
+    unsigned long i;
+    GPS_REGISTERS regs;
+    gpscore_epoch last;
+    gpsclock clock;
+    nmea_epoch epoch;
+    char out[512];
+    int len;
+
+    memset(&regs, 0, sizeof(regs));
+    memset(&last, 0, sizeof(last));
+    gps_clock_init(&clock, 18);
+    for(i=0; i<nrecords; i++) {
+        memcpy(&regs.status, &records[i].status, 1);
+        memcpy((uint8_t*)&regs + I2C_GPS_LOCATION, &records[i].location, sizeof(GPS_COORDINATES));
+        memcpy((uint8_t*)&regs + I2C_GPS_GROUND_SPEED, &records[i].detail, sizeof(GPS_DETAIL));
+        gpscore_decode(&regs, &epoch);
+        if(!gpscore_epoch_new(&last, epoch.status, &epoch.detail))
+            continue;
+        len = gpscore_format(out, sizeof(out), NMEA_ALL, &clock, &epoch);
+        if(len > 0)
+            r->bytes += len;
+    }
+    sink += out[7];
+}
+
+// one learn and next poll decision per op, updates every 100ms polled at 25ms
+static void bench_sched(bench_result* r)
+{
+    unsigned long i, sum = 0;
+    gpscore_sched sched;
+    int64_t now = 1000000000;
+
+    gpscore_sched_init(&sched, 25);
+    for(i=0; i<nrecords; i++) {
+        now += 25000000;
+        if((i & 3) == 0)
+            gpscore_sched_learn(&sched, now + (records[i].detail.time & 0xfffff));
+        sum += gpscore_sched_next(&sched, now);
+    }
+    sink += sum;
+}
+
+typedef struct {
+    const char* name;
+    void (*run)(bench_result* r);
+    int sentences;
+} bench_case;
+
+static const bench_case cases[] = {
+    { "nmea_checksum", bench_checksum, 1 },
+    { "degrees2dms", bench_degrees2dms, 0 },
+    { "gps_time2tm", bench_time2tm, 0 },
+    { "gps_clock_convert", bench_clock, 0 },
+    { "nmea_gga", bench_gga, 1 },
+    { "nmea_zda", bench_zda, 1 },
+    { "gpscore_pipeline", bench_pipeline, 0 },
+    { "gpscore_sched", bench_sched, 0 },
+    { NULL }
+};
+
+/// runs a benchmark several rounds and keeps the fastest
+static void run_case(const bench_case* c, int rounds, bench_result* best)
+{
+    bench_result r;
+    double start;
+    int i;
+
+    memset(best, 0, sizeof(*best));
+    for(i=0; i<rounds; i++) {
+        memset(&r, 0, sizeof(r));
+        r.name = c->name;
+        r.ops = nrecords;
+        r.sentences = c->sentences;
+        start = now();
+        c->run(&r);
+        r.seconds = now() - start;
+        if(i==0 || r.seconds < best->seconds)
+            *best = r;
+    }
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-n records] [-r rounds] [-m]\n"
+                    "  -n records   number of synthetic GPS records (default %d)\n"
+                    "  -r rounds    rounds per benchmark, the fastest is reported (default %d)\n"
+                    "  -m           machine readable CSV output\n",
+            prog, DEFAULT_RECORDS, DEFAULT_ROUNDS);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long n = DEFAULT_RECORDS;
+    int rounds = DEFAULT_ROUNDS;
+    int machine = 0;
+    int opt;
+    const bench_case* c;
+    bench_result r;
+    double ns_op, ops_s, bytes_s;
+
+    while((opt = getopt(argc, argv, "n:r:mh")) != -1) {
+        switch(opt) {
+            case 'n': n = strtoul(optarg, NULL, 0); break;
+            case 'r': rounds = atoi(optarg); break;
+            case 'm': machine = 1; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if(n == 0 || rounds < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    generate_records(n);
+    generate_bodies();
+
+    if(machine)
+        printf("benchmark,ops,seconds,ns_per_op,ops_per_sec,sentences_per_sec,bytes_per_sec\n");
+    else
+        printf("%-18s %12s %10s %14s %14s %14s\n", "benchmark", "ops", "ns/op", "ops/s", "sentences/s", "bytes/s");
+
+    for(c = cases; c->name != NULL; c++) {
+        run_case(c, rounds, &r);
+        ns_op = r.seconds * 1e9 / r.ops;
+        ops_s = r.ops / r.seconds;
+        bytes_s = r.bytes / r.seconds;
+        if(machine)
+            printf("%s,%lu,%.6f,%.2f,%.0f,%.0f,%.0f\n", r.name, r.ops, r.seconds, ns_op, ops_s,
+                   r.sentences ? ops_s : 0.0, bytes_s);
+        else
+            printf("%-18s %12lu %10.2f %14.0f %14.0f %14.0f\n", r.name, r.ops, ns_op, ops_s,
+                   r.sentences ? ops_s : 0.0, bytes_s);
+    }
+
+    free(records);
+    free(bodies);
+    free(body_lengths);
+    return 0;
+}
@@ -0,0 +1,114 @@
+
+#include "binrec.h"
+
+#if !defined(__KERNEL__)
+#include <errno.h>
+#else
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#endif
+
+// CRC-16/CCITT remainders of every nibble, half the work of a bitwise CRC without a 512 byte table
+static const uint16_t binrec_crc_nibble[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+};
+
+uint16_t binrec_crc16(const uint8_t* data, int length, uint16_t crc)
+{
+    while(length-- > 0) {
+        crc = (uint16_t)(crc << 4) ^ binrec_crc_nibble[(crc >> 12) ^ (*data >> 4)];
+        crc = (uint16_t)(crc << 4) ^ binrec_crc_nibble[(crc >> 12) ^ (*data & 0x0f)];
+        data++;
+    }
+    return crc;
+}
+
+static inline void binrec_put16(uint8_t* p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void binrec_put32(uint8_t* p, uint32_t v)
+{
+    binrec_put16(p, (uint16_t)v);
+    binrec_put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static inline uint16_t binrec_get16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t binrec_get32(const uint8_t* p)
+{
+    return binrec_get16(p) | ((uint32_t)binrec_get16(p + 2) << 16);
+}
+
+int binrec_encode(uint8_t* out, int out_length, const struct quadrino_gps_fix_record* record)
+{
+    uint64_t timestamp = (uint64_t)record->timestamp_ns;
+
+    if(out_length < QUADRINO_GPS_BINREC_SIZE)
+        return -ENOSPC;
+
+    out[0] = QUADRINO_GPS_BINREC_SYNC0;
+    out[1] = QUADRINO_GPS_BINREC_SYNC1;
+    out[2] = QUADRINO_GPS_BINREC_VERSION;
+    out[3] = QUADRINO_GPS_BINREC_SIZE;
+    binrec_put32(out + 4, record->seq);
+    binrec_put32(out + 8, (uint32_t)timestamp);
+    binrec_put32(out + 12, (uint32_t)(timestamp >> 32));
+    binrec_put32(out + 16, (uint32_t)record->location.lat);
+    binrec_put32(out + 20, (uint32_t)record->location.lon);
+    binrec_put16(out + 24, record->detail.ground_speed);
+    binrec_put16(out + 26, record->detail.altitude);
+    binrec_put16(out + 28, record->detail.ground_course);
+    binrec_put16(out + 30, record->detail.week);
+    binrec_put32(out + 32, record->detail.time);
+    out[36] = *(const uint8_t*)&record->status;
+    out[37] = (uint8_t)record->flags;
+    binrec_put16(out + 38, binrec_crc16(out, QUADRINO_GPS_BINREC_SIZE - 2, 0xffff));
+    return QUADRINO_GPS_BINREC_SIZE;
+}
+
+int binrec_decode(const uint8_t* in, int in_length, struct quadrino_gps_fix_record* record)
+{
+    if(in_length < 4)
+        return -EAGAIN;
+    if(in[0] != QUADRINO_GPS_BINREC_SYNC0 || in[1] != QUADRINO_GPS_BINREC_SYNC1)
+        return -EBADMSG;
+    if(in[2] != QUADRINO_GPS_BINREC_VERSION)
+        return -EPROTONOSUPPORT;
+    if(in[3] != QUADRINO_GPS_BINREC_SIZE)
+        return -EBADMSG;
+    if(in_length < QUADRINO_GPS_BINREC_SIZE)
+        return -EAGAIN;
+    if(binrec_crc16(in, QUADRINO_GPS_BINREC_SIZE - 2, 0xffff) != binrec_get16(in + 38))
+        return -EBADMSG;
+
+    record->seq = binrec_get32(in + 4);
+    record->flags = in[37];
+    record->timestamp_ns = (int64_t)(binrec_get32(in + 8) | ((uint64_t)binrec_get32(in + 12) << 32));
+    record->location.lat = (int32_t)binrec_get32(in + 16);
+    record->location.lon = (int32_t)binrec_get32(in + 20);
+    record->detail.ground_speed = binrec_get16(in + 24);
+    record->detail.altitude = binrec_get16(in + 26);
+    record->detail.ground_course = binrec_get16(in + 28);
+    record->detail.week = binrec_get16(in + 30);
+    record->detail.time = binrec_get32(in + 32);
+    *(uint8_t*)&record->status = in[36];
+    return QUADRINO_GPS_BINREC_SIZE;
+}
+
+int binrec_resync(const uint8_t* in, int in_length)
+{
+    int i;
+
+    for(i = 1; i < in_length; i++) {
+        if(in[i] == QUADRINO_GPS_BINREC_SYNC0 && (i + 1 == in_length || in[i + 1] == QUADRINO_GPS_BINREC_SYNC1))
+            return i;
+    }
+    return in_length;
+}
@@ -0,0 +1,33 @@
+#ifndef __QUADRINO_GPS_BINREC_H
+#define __QUADRINO_GPS_BINREC_H
+
+#include "gps-quadrino-uapi.h"
+
+/*
+ * Compact binary fix records
+ *
+ * An alternative to NMEA for high rate links. Each module update becomes one fixed size record holding the raw
+ * register values and the kernel timestamp, framed by a sync word, a version and a CRC so a consumer can find record
+ * boundaries in a byte stream and reject damaged records. Every field is little-endian regardless of the host.
+ */
+
+/// \brief Computes the CRC-16/CCITT (polynomial 0x1021) of a buffer, start with crc 0xffff.
+uint16_t binrec_crc16(const uint8_t* data, int length, uint16_t crc);
+
+/// \brief Encodes a fix record into its QUADRINO_GPS_BINREC_SIZE byte wire format.
+/// Only the low 8 bits of the record's flags are carried.
+/// \returns QUADRINO_GPS_BINREC_SIZE, or -ENOSPC if out_length is too small
+int binrec_encode(uint8_t* out, int out_length, const struct quadrino_gps_fix_record* record);
+
+/// \brief Decodes one record from the start of a buffer.
+/// \returns QUADRINO_GPS_BINREC_SIZE on success, -EAGAIN if the buffer holds less than a record, -EBADMSG if the
+/// buffer doesn't start with a valid record, or -EPROTONOSUPPORT for a record of an unknown version
+int binrec_decode(const uint8_t* in, int in_length, struct quadrino_gps_fix_record* record);
+
+/// \brief Finds the start of the next record after a decode failure.
+/// \returns the offset of the first possible sync word after the start of the buffer, or in_length if there is none.
+/// A sync byte at the very end is kept since the rest of the word may not have arrived yet.
+int binrec_resync(const uint8_t* in, int in_length);
+
+
+#endif // __QUADRINO_GPS_BINREC_H
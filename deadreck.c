@@ -0,0 +1,112 @@
+
+#include "deadreck.h"
+
+#if !defined(__KERNEL__)
+#include <errno.h>
+#define deadreck_div64(n, d)    ((n) / (d))
+#else
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/math64.h>
+#define deadreck_div64(n, d)    div_s64(n, d)
+#endif
+
+// sin() of every whole degree 0..90 in Q15, tenths of a degree are interpolated
+static const int16_t deadreck_sin_table[91] = {
+        0,   572,  1144,  1715,  2286,  2856,  3425,  3993,  4560,  5126,
+     5690,  6252,  6813,  7371,  7927,  8481,  9032,  9580, 10126, 10668,
+    11207, 11743, 12275, 12803, 13328, 13848, 14364, 14876, 15383, 15886,
+    16383, 16876, 17364, 17846, 18323, 18794, 19260, 19720, 20173, 20621,
+    21062, 21497, 21925, 22347, 22762, 23170, 23571, 23964, 24351, 24730,
+    25101, 25465, 25821, 26169, 26509, 26841, 27165, 27481, 27788, 28087,
+    28377, 28659, 28932, 29196, 29451, 29697, 29934, 30162, 30381, 30591,
+    30791, 30982, 31163, 31335, 31498, 31650, 31794, 31927, 32051, 32165,
+    32269, 32364, 32448, 32523, 32587, 32642, 32687, 32722, 32747, 32762,
+    32767
+};
+
+// 1e-7 degrees of latitude per cm in Q16, one degree is 111319.49m on the WGS84 equator
+#define DEADRECK_CM_TO_LAT_Q16  58872
+
+// below cos(89.0) the longitude scale blows up, the receiver is on top of the pole anyway
+#define DEADRECK_COS_MIN        572
+
+// hundredths of a second in a GPS week
+#define DEADRECK_WEEK_TIME      (7*8640000UL)
+
+// sin() of an angle in 1e-4 degrees, fine enough that the latitude scale stays exact near the poles
+static int32_t deadreck_sin_e4(int32_t angle)
+{
+    int32_t sign = 1, i, f, v;
+
+    angle %= 3600000;
+    if(angle < 0)
+        angle += 3600000;
+    if(angle >= 1800000) {
+        angle -= 1800000;
+        sign = -1;
+    }
+    if(angle > 900000)
+        angle = 1800000 - angle;
+
+    i = angle / 10000;
+    f = angle - i*10000;
+    v = deadreck_sin_table[i];
+    if(f)
+        v += ((deadreck_sin_table[i + 1] - v) * f) / 10000;
+    return sign * v;
+}
+
+int32_t deadreck_sin(int32_t deg10)
+{
+    return deadreck_sin_e4((deg10 % 3600) * 1000);
+}
+
+int32_t deadreck_cos(int32_t deg10)
+{
+    return deadreck_sin(deg10 + 900);
+}
+
+int deadreck_predict(const GPS_COORDINATES* location, const GPS_DETAIL* detail, uint32_t dt,
+                     GPS_COORDINATES* out_location, GPS_DETAIL* out_detail)
+{
+    int32_t distance, north, east, coslat;
+    int64_t lat, lon;
+    uint32_t time;
+
+    if(dt > DEADRECK_MAX_HORIZON)
+        return -ERANGE;
+
+    // distance travelled in cm split into north and east components, both fit 32 bits within the horizon
+    distance = (int32_t)(((uint32_t)detail->ground_speed * dt + 500) / 1000);
+    north = (int32_t)(((int64_t)distance * deadreck_cos(detail->ground_course) + (1 << 14)) >> 15);
+    east = (int32_t)(((int64_t)distance * deadreck_sin(detail->ground_course) + (1 << 14)) >> 15);
+
+    // a cm east covers more longitude the further we are from the equator
+    lat = location->lat + (((int64_t)north * DEADRECK_CM_TO_LAT_Q16 + (1 << 15)) >> 16);
+    coslat = deadreck_sin_e4(location->lat / 1000 + 900000);
+    lon = location->lon;
+    if(coslat >= DEADRECK_COS_MIN)
+        lon += deadreck_div64((int64_t)east * DEADRECK_CM_TO_LAT_Q16, 2*coslat);
+
+    if(lat > 900000000)
+        lat = 900000000;
+    else if(lat < -900000000)
+        lat = -900000000;
+    if(lon > 1800000000)
+        lon -= 3600000000LL;
+    else if(lon < -1800000000)
+        lon += 3600000000LL;
+
+    out_location->lat = (int32_t)lat;
+    out_location->lon = (int32_t)lon;
+
+    *out_detail = *detail;
+    time = detail->time + (dt + 5) / 10;
+    if(time >= DEADRECK_WEEK_TIME) {
+        time -= DEADRECK_WEEK_TIME;
+        out_detail->week++;
+    }
+    out_detail->time = time;
+    return 0;
+}
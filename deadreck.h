@@ -0,0 +1,32 @@
+#ifndef __QUADRINO_GPS_DEADRECK_H
+#define __QUADRINO_GPS_DEADRECK_H
+
+#include "registers.h"
+
+/*
+ * Dead reckoning
+ *
+ * Predicts where the receiver is some time after a fix from the fix's ground speed and course, so the driver can
+ * output positions at a higher rate than the module updates. Uses integer math only so it runs in the kernel. The
+ * earth is treated as flat around the fix which is accurate to well below the register resolution over the few
+ * hundred meters covered between two fixes.
+ */
+
+/// The longest extrapolation deadreck_predict() accepts, in msecs
+#define DEADRECK_MAX_HORIZON    10000
+
+/// \brief Returns sin() of an angle in tenths of a degree as a Q15 fixed-point value (32767 is 1.0).
+int32_t deadreck_sin(int32_t deg10);
+
+/// \brief Returns cos() of an angle in tenths of a degree as a Q15 fixed-point value (32767 is 1.0).
+int32_t deadreck_cos(int32_t deg10);
+
+/// \brief Extrapolates a fix by dt msecs.
+/// The location moves along ground_course at ground_speed, the GPS time of week in detail advances by dt including
+/// the rollover into the next week. Speed, course and altitude are held.
+/// \returns 0 on success, or -ERANGE if dt is larger than DEADRECK_MAX_HORIZON
+int deadreck_predict(const GPS_COORDINATES* location, const GPS_DETAIL* detail, uint32_t dt,
+                     GPS_COORDINATES* out_location, GPS_DETAIL* out_detail);
+
+
+#endif // __QUADRINO_GPS_DEADRECK_H
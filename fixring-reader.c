@@ -0,0 +1,97 @@
+// Sample reader for the binary fix ring device
+// usage: ./gps_quadrino_fixring_reader [-a] [device]      (default device /dev/gpsfix0)
+//
+// Maps the ring read-only and prints each new fix. Reading a fix needs no system calls, the reader only sleeps
+// between checks of the ring's head so it doesn't spin a CPU. Use -a to print every record rather than only the
+// latest one.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "gps-quadrino-uapi.h"
+
+static void print_fix(const struct quadrino_gps_fix_record* fix)
+{
+    printf("%10u %6lld.%06lld  sats:%-2d fix:%s  %11.7f %12.7f  alt:%-5u  week:%u tow:%u\n",
+           fix->seq,
+           (long long)(fix->timestamp_ns / 1000000000), (long long)(fix->timestamp_ns % 1000000000) / 1000,
+           fix->status.numsats,
+           fix->status.gps3dfix ? "3d" : fix->status.gps2dfix ? "2d" : "--",
+           fix->location.lat / 10000000.0, fix->location.lon / 10000000.0,
+           fix->detail.altitude, fix->detail.week, fix->detail.time);
+}
+
+int main(int argc, char** argv)
+{
+    const char* device = "/dev/gpsfix0";
+    int all = 0, opt, fd;
+    struct quadrino_gps_fixring_header* header;
+    const struct quadrino_gps_fix_record* records;
+    struct quadrino_gps_fix_record fix;
+    size_t size;
+    uint32_t next, head;
+    struct timespec nap = { 0, 5000000 };
+
+    while((opt = getopt(argc, argv, "ah")) != -1) {
+        switch(opt) {
+            case 'a': all = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-a] [device]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(optind < argc)
+        device = argv[optind];
+
+    fd = open(device, O_RDONLY);
+    if(fd < 0) {
+        perror(device);
+        return 1;
+    }
+
+    // map the header alone first to learn how large the ring is
+    header = (struct quadrino_gps_fixring_header*)mmap(NULL, sizeof(*header), PROT_READ, MAP_SHARED, fd, 0);
+    if(header == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if(header->magic != QUADRINO_GPS_FIXRING_MAGIC || header->version != QUADRINO_GPS_FIXRING_VERSION ||
+       header->record_size != sizeof(struct quadrino_gps_fix_record)) {
+        fprintf(stderr, "%s: unsupported fix ring (magic %08x version %u)\n", device, header->magic, header->version);
+        return 1;
+    }
+    size = header->records_offset + (size_t)header->capacity * header->record_size;
+    munmap(header, sizeof(*header));
+
+    header = (struct quadrino_gps_fixring_header*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if(header == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    records = (const struct quadrino_gps_fix_record*)((const uint8_t*)header + header->records_offset);
+
+    next = quadrino_gps_fixring_head(header);
+    for(;;) {
+        head = quadrino_gps_fixring_head(header);
+        if(head == next) {
+            nanosleep(&nap, NULL);
+            continue;
+        }
+
+        // either follow every record still in the ring, or jump straight to the latest
+        if(!all || head - next > header->capacity)
+            next = all ? head - header->capacity : head - 1;
+        for(; next != head; next++) {
+            if(quadrino_gps_fixring_read(header, records, next, &fix) == 0)
+                print_fix(&fix);
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
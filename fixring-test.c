@@ -0,0 +1,137 @@
+// Throughput test for the binary fix ring
+// usage: ./gps_quadrino_fixring_test [-n records] [-c capacity] [-r records/s]
+//
+// A producer thread simulates the driver and pushes records into a ring in ordinary memory, as fast as it can or at
+// the given rate, while
+// the consumer follows it using the same lock-free protocol as a /dev/gpsfix consumer. Every record carries values
+// derived from its sequence number so the consumer can detect torn reads.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "gps-quadrino-uapi.h"
+
+#define DEFAULT_RECORDS   10000000
+#define DEFAULT_CAPACITY  256
+
+static struct quadrino_gps_fixring_header* header;
+static struct quadrino_gps_fix_record* records;
+static uint32_t nrecords;
+static double rate;                 // records per second, zero for unlimited
+static volatile int producer_done;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* producer(void* arg)
+{
+    struct quadrino_gps_fix_record fix;
+    uint32_t i;
+    double start = now(), ahead;
+    struct timespec nap;
+
+    memset(&fix, 0, sizeof(fix));
+    for(i=0; i<nrecords; i++) {
+        if(rate > 0 && (ahead = i / rate - (now() - start)) > 0) {
+            // sleep rather than spin so the consumer gets the CPU on small machines
+            nap.tv_sec = (time_t)ahead;
+            nap.tv_nsec = (long)((ahead - nap.tv_sec) * 1e9);
+            nanosleep(&nap, NULL);
+        }
+        fix.timestamp_ns = (int64_t)i * 100000000;
+        fix.location.lat = (int32_t)i;
+        fix.location.lon = (int32_t)~i;
+        fix.detail.time = i * 10;
+        fix.detail.week = (uint16_t)(i >> 16);
+        quadrino_gps_fixring_push(header, records, &fix);
+    }
+    __atomic_store_n(&producer_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t capacity = DEFAULT_CAPACITY;
+    pthread_t thread;
+    struct quadrino_gps_fix_record fix;
+    uint32_t next = 0, head;
+    unsigned long read = 0, lost = 0, overwritten = 0, torn = 0;
+    double start, elapsed;
+    int opt;
+
+    nrecords = DEFAULT_RECORDS;
+    while((opt = getopt(argc, argv, "n:c:r:h")) != -1) {
+        switch(opt) {
+            case 'n': nrecords = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'c': capacity = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'r': rate = atof(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n records] [-c capacity] [-r records/s]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        fprintf(stderr, "capacity must be a power of two\n");
+        return 2;
+    }
+
+    header = (struct quadrino_gps_fixring_header*)calloc(1, sizeof(*header));
+    records = (struct quadrino_gps_fix_record*)calloc(capacity, sizeof(*records));
+    if(header == NULL || records == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    header->magic = QUADRINO_GPS_FIXRING_MAGIC;
+    header->version = QUADRINO_GPS_FIXRING_VERSION;
+    header->record_size = sizeof(struct quadrino_gps_fix_record);
+    header->capacity = capacity;
+
+    start = now();
+    pthread_create(&thread, NULL, producer, NULL);
+    for(;;) {
+        head = quadrino_gps_fixring_head(header);
+        if(head == next) {
+            if(__atomic_load_n(&producer_done, __ATOMIC_ACQUIRE) && head == quadrino_gps_fixring_head(header))
+                break;
+            continue;
+        }
+        if(head - next > capacity) {
+            lost += head - capacity - next;
+            next = head - capacity;
+        }
+        for(; next != head; next++) {
+            if(quadrino_gps_fixring_read(header, records, next, &fix) != 0) {
+                overwritten++;
+                continue;
+            }
+            if(fix.location.lat != (int32_t)next || fix.location.lon != (int32_t)~next ||
+               fix.detail.time != next * 10 || fix.timestamp_ns != (int64_t)next * 100000000)
+                torn++;
+            read++;
+        }
+    }
+    elapsed = now() - start;
+    pthread_join(thread, NULL);
+
+    printf("records %u  capacity %u  %.3f s\n", nrecords, capacity, elapsed);
+    printf("produced %.0f records/s  consumed %lu (%.0f records/s)  lost %lu  overwritten %lu\n",
+           nrecords / elapsed, read, read / elapsed, lost, overwritten);
+    if(torn) {
+        printf("FAILED   %lu torn records\n", torn);
+        return 1;
+    }
+    if(read + lost + overwritten != nrecords) {
+        printf("FAILED   %lu records unaccounted for\n", nrecords - (read + lost + overwritten));
+        return 1;
+    }
+    return 0;
+}
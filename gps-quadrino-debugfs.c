@@ -0,0 +1,146 @@
+/* Quadrino GPS I2C driver - debugfs statistics
+ *
+ * Exposes the per-device counters and latency histograms collected by the
+ * poll cycle under /sys/kernel/debug/gps_quadrino/<i2c device>/. Writing
+ * anything to the reset file clears them.
+ *
+ * Copyright (C) 2016 Colin F. MacKenzie <colin@flyingeinstein.com>
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "gps-quadrino.h"
+
+static struct dentry *quadrino_gps_debugfs_root;
+
+static void quadrino_gps_hist_show(struct seq_file *s, const char *name, const struct quadrino_gps_hist *hist)
+{
+   int i;
+
+   seq_printf(s, "%s: count %llu avg %llu max %llu ns\n", name, hist->count,
+       hist->count ? div64_u64(hist->total, hist->count) : 0, hist->max);
+   for (i = 0; i < QUADRINO_GPS_HIST_BUCKETS; i++) {
+       if (hist->buckets[i])
+           seq_printf(s, "  >= %10llu ns: %llu\n", i ? 1ULL << (i - 1) : 0, hist->buckets[i]);
+   }
+}
+
+static int quadrino_gps_histograms_show(struct seq_file *s, void *unused)
+{
+   struct quadrino_gps_stats *stats = s->private;
+
+   quadrino_gps_hist_show(s, "status_latency", &stats->status_latency);
+   quadrino_gps_hist_show(s, "burst_latency", &stats->burst_latency);
+   quadrino_gps_hist_show(s, "poll_jitter", &stats->jitter);
+   quadrino_gps_hist_show(s, "format_time", &stats->format_time);
+   return 0;
+}
+
+static int quadrino_gps_counters_show(struct seq_file *s, void *unused)
+{
+   struct quadrino_gps_stats *stats = s->private;
+   int reg;
+
+   seq_printf(s, "cycles: %llu\n", stats->cycles);
+   seq_printf(s, "updates: %llu\n", stats->updates);
+   seq_printf(s, "duplicates: %llu\n", stats->duplicates);
+   seq_printf(s, "unread: %llu\n", stats->unread);
+   seq_printf(s, "estimates: %llu\n", stats->estimates);
+   seq_printf(s, "events: %llu\n", stats->events);
+   seq_printf(s, "retries: %llu\n", stats->retries);
+   seq_printf(s, "retried_ok: %llu\n", stats->retried_ok);
+   seq_printf(s, "backoffs: %llu\n", stats->backoffs);
+   seq_printf(s, "bus_resets: %llu\n", stats->bus_resets);
+   seq_printf(s, "reprobes: %llu\n", stats->reprobes);
+   seq_printf(s, "reprobe_failures: %llu\n", stats->reprobe_failures);
+   seq_printf(s, "tty_bytes: %llu\n", stats->tty_bytes);
+   seq_printf(s, "tty_dropped: %llu\n", stats->tty_dropped);
+   seq_printf(s, "stream_bytes: %llu\n", stats->stream_bytes);
+   for (reg = 0; reg < ARRAY_SIZE(stats->failures); reg++) {
+       if (stats->failures[reg])
+           seq_printf(s, "failures[%d]: %u\n", reg, stats->failures[reg]);
+   }
+   return 0;
+}
+
+static int quadrino_gps_histograms_open(struct inode *inode, struct file *filp)
+{
+   return single_open(filp, quadrino_gps_histograms_show, inode->i_private);
+}
+
+static int quadrino_gps_counters_open(struct inode *inode, struct file *filp)
+{
+   return single_open(filp, quadrino_gps_counters_show, inode->i_private);
+}
+
+static ssize_t quadrino_gps_reset_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
+{
+   struct quadrino_gps *gps = filp->private_data;
+
+   /* the poll cycle updates the counters under poll_lock, dir stays for remove */
+   mutex_lock(&gps->poll_lock);
+   memset(&gps->stats, 0, offsetof(struct quadrino_gps_stats, dir));
+   mutex_unlock(&gps->poll_lock);
+   return count;
+}
+
+static const struct file_operations quadrino_gps_histograms_fops = {
+   .owner = THIS_MODULE,
+   .open = quadrino_gps_histograms_open,
+   .read = seq_read,
+   .llseek = seq_lseek,
+   .release = single_release,
+};
+
+static const struct file_operations quadrino_gps_counters_fops = {
+   .owner = THIS_MODULE,
+   .open = quadrino_gps_counters_open,
+   .read = seq_read,
+   .llseek = seq_lseek,
+   .release = single_release,
+};
+
+static const struct file_operations quadrino_gps_reset_fops = {
+   .owner = THIS_MODULE,
+   .open = simple_open,
+   .write = quadrino_gps_reset_write,
+   .llseek = noop_llseek,
+};
+
+void quadrino_gps_debugfs_add(struct quadrino_gps *gps, const char *name)
+{
+   struct quadrino_gps_stats *stats = &gps->stats;
+
+   /* debugfs is best effort, the driver works without it */
+   if (IS_ERR_OR_NULL(quadrino_gps_debugfs_root))
+       return;
+
+   stats->dir = debugfs_create_dir(name, quadrino_gps_debugfs_root);
+   if (IS_ERR_OR_NULL(stats->dir))
+       return;
+
+   debugfs_create_file("counters", 0444, stats->dir, stats, &quadrino_gps_counters_fops);
+   debugfs_create_file("histograms", 0444, stats->dir, stats, &quadrino_gps_histograms_fops);
+   debugfs_create_file("reset", 0200, stats->dir, gps, &quadrino_gps_reset_fops);
+}
+
+void quadrino_gps_debugfs_remove(struct quadrino_gps_stats *stats)
+{
+   debugfs_remove_recursive(stats->dir);
+   stats->dir = NULL;
+}
+
+void quadrino_gps_debugfs_init(void)
+{
+   quadrino_gps_debugfs_root = debugfs_create_dir("gps_quadrino", NULL);
+}
+
+void quadrino_gps_debugfs_exit(void)
+{
+   debugfs_remove_recursive(quadrino_gps_debugfs_root);
+   quadrino_gps_debugfs_root = NULL;
+}
@@ -0,0 +1,281 @@
+/* Quadrino GPS I2C driver - status event channel
+ *
+ * Exposes /dev/gpseventN, a queue of typed records for every edge of the
+ * fix state, waypoint reached flag and satellite count. The edges are found
+ * once per module update by comparing the status register with the last
+ * one, every open file then gets its own copy of the record so readers
+ * don't consume each other's events. Readers sleep in read() or poll(), or
+ * get SIGIO with O_ASYNC. The record format is in gps-quadrino-uapi.h.
+ *
+ * Copyright (C) 2016 Colin F. MacKenzie <colin@flyingeinstein.com>
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+
+#include "gps-quadrino.h"
+
+/* per-open event queue */
+struct quadrino_gps_events_reader {
+   struct quadrino_gps_events *events;
+   struct list_head node;
+   struct mutex lock;                  /* serializes readers sharing the file */
+   struct fasync_struct *fasync;
+   unsigned int mask;                  /* QUADRINO_GPS_EVENT_MASK() bits to queue */
+   u32 lost;                           /* records dropped since the last one queued */
+   DECLARE_KFIFO(fifo, struct quadrino_gps_event, QUADRINO_GPS_EVENT_QUEUE);
+};
+
+static bool quadrino_gps_events_pending(struct quadrino_gps_events_reader *reader)
+{
+   return !kfifo_is_empty(&reader->fifo) || reader->events->removed;
+}
+
+static int quadrino_gps_events_open(struct inode *inode, struct file *filp)
+{
+   /* misc_open() stores the miscdevice in private_data */
+   struct quadrino_gps_events *events = container_of(filp->private_data, struct quadrino_gps_events, misc);
+   struct quadrino_gps_events_reader *reader;
+
+   if (filp->f_mode & FMODE_WRITE)
+       return -EPERM;
+
+   reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+   if (!reader)
+       return -ENOMEM;
+
+   reader->events = events;
+   mutex_init(&reader->lock);
+   INIT_KFIFO(reader->fifo);
+   reader->mask = QUADRINO_GPS_EVENT_ALL;
+   filp->private_data = reader;
+
+   spin_lock(&events->lock);
+   list_add_tail(&reader->node, &events->readers);
+   spin_unlock(&events->lock);
+
+   if (events->open)
+       events->open(events);
+   return nonseekable_open(inode, filp);
+}
+
+static int quadrino_gps_events_fasync(int fd, struct file *filp, int on)
+{
+   struct quadrino_gps_events_reader *reader = filp->private_data;
+
+   return fasync_helper(fd, filp, on, &reader->fasync);
+}
+
+static int quadrino_gps_events_release(struct inode *inode, struct file *filp)
+{
+   struct quadrino_gps_events_reader *reader = filp->private_data;
+   struct quadrino_gps_events *events = reader->events;
+
+   spin_lock(&events->lock);
+   list_del(&reader->node);
+   spin_unlock(&events->lock);
+
+   fasync_helper(-1, filp, 0, &reader->fasync);
+   kfree(reader);
+   if (events->release)
+       events->release(events);
+   return 0;
+}
+
+static ssize_t quadrino_gps_events_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+   struct quadrino_gps_events_reader *reader = filp->private_data;
+   struct quadrino_gps_events *events = reader->events;
+   struct quadrino_gps_event event;
+   size_t copied = 0;
+   int result;
+
+   if (count < sizeof(event))
+       return -EINVAL;
+
+   if (mutex_lock_interruptible(&reader->lock))
+       return -ERESTARTSYS;
+
+   while (!quadrino_gps_events_pending(reader)) {
+       mutex_unlock(&reader->lock);
+       if (filp->f_flags & O_NONBLOCK)
+           return -EAGAIN;
+       result = wait_event_interruptible(events->wait, quadrino_gps_events_pending(reader));
+       if (result)
+           return result;
+       if (mutex_lock_interruptible(&reader->lock))
+           return -ERESTARTSYS;
+   }
+
+   /* the producer adds under the lock, copy out one record at a time so the lock isn't held over a fault */
+   while (count - copied >= sizeof(event)) {
+       spin_lock(&events->lock);
+       result = kfifo_get(&reader->fifo, &event);
+       spin_unlock(&events->lock);
+       if (!result)
+           break;
+       if (copy_to_user(buf + copied, &event, sizeof(event))) {
+           if (!copied)
+               copied = -EFAULT;
+           break;
+       }
+       copied += sizeof(event);
+   }
+
+   mutex_unlock(&reader->lock);
+   return copied;
+}
+
+static unsigned int quadrino_gps_events_poll(struct file *filp, poll_table *wait)
+{
+   struct quadrino_gps_events_reader *reader = filp->private_data;
+   struct quadrino_gps_events *events = reader->events;
+   unsigned int mask = 0;
+
+   poll_wait(filp, &events->wait, wait);
+   if (!kfifo_is_empty(&reader->fifo))
+       mask |= POLLIN | POLLRDNORM;
+   if (events->removed)
+       mask |= POLLHUP;
+   return mask;
+}
+
+static long quadrino_gps_events_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+   struct quadrino_gps_events_reader *reader = filp->private_data;
+   struct quadrino_gps_events *events = reader->events;
+   int mask;
+
+   /* the event mask is per open file, everything else is up to the driver */
+   switch (cmd) {
+   case QUADRINO_GPS_IOC_SET_EVENTS:
+       if (get_user(mask, (int __user *)arg))
+           return -EFAULT;
+       if (mask & ~QUADRINO_GPS_EVENT_ALL)
+           return -EINVAL;
+       WRITE_ONCE(reader->mask, mask);
+       return 0;
+   case QUADRINO_GPS_IOC_GET_EVENTS:
+       return put_user(READ_ONCE(reader->mask), (int __user *)arg);
+   }
+
+   if (!events->ioctl)
+       return -ENOTTY;
+   return events->ioctl(events, cmd, arg);
+}
+
+static const struct file_operations quadrino_gps_events_fops = {
+   .owner = THIS_MODULE,
+   .open = quadrino_gps_events_open,
+   .release = quadrino_gps_events_release,
+   .read = quadrino_gps_events_read,
+   .poll = quadrino_gps_events_poll,
+   .fasync = quadrino_gps_events_fasync,
+   .unlocked_ioctl = quadrino_gps_events_ioctl,
+   .compat_ioctl = quadrino_gps_events_ioctl,
+   .llseek = no_llseek,
+};
+
+int quadrino_gps_events_init(struct quadrino_gps_events *events, struct device *parent, int index)
+{
+   int result;
+
+   spin_lock_init(&events->lock);
+   INIT_LIST_HEAD(&events->readers);
+   init_waitqueue_head(&events->wait);
+   events->removed = false;
+   events->valid = false;
+
+   snprintf(events->name, sizeof(events->name), "gpsevent%d", index);
+   events->misc.minor = MISC_DYNAMIC_MINOR;
+   events->misc.name = events->name;
+   events->misc.fops = &quadrino_gps_events_fops;
+   events->misc.parent = parent;
+   events->misc.mode = 0444;
+
+   result = misc_register(&events->misc);
+   if (!result)
+       events->registered = true;
+   return result;
+}
+
+void quadrino_gps_events_cleanup(struct quadrino_gps_events *events)
+{
+   if (!events->registered)
+       return;
+
+   /* no new readers, open ones drain their queue and then see EOF */
+   misc_deregister(&events->misc);
+   events->registered = false;
+   events->removed = true;
+   wake_up_interruptible(&events->wait);
+}
+
+/* Queue one record for every reader that selected its type. A full queue
+ * drops its oldest record, the latest state matters most to a supervisor.
+ */
+static void quadrino_gps_events_queue(struct quadrino_gps_events *events, u16 type, u8 value, u8 previous,
+   ktime_t timestamp)
+{
+   struct quadrino_gps_events_reader *reader;
+   struct quadrino_gps_event event, skipped;
+
+   event.timestamp_ns = ktime_to_ns(timestamp);
+   event.type = type;
+   event.value = value;
+   event.previous = previous;
+
+   list_for_each_entry(reader, &events->readers, node) {
+       if (!(READ_ONCE(reader->mask) & QUADRINO_GPS_EVENT_MASK(type)))
+           continue;
+       if (kfifo_is_full(&reader->fifo) && kfifo_get(&reader->fifo, &skipped))
+           reader->lost++;
+       event.lost = reader->lost;
+       reader->lost = 0;
+       kfifo_put(&reader->fifo, event);
+       kill_fasync(&reader->fasync, SIGIO, POLL_IN);
+   }
+}
+
+static u8 quadrino_gps_events_fix(STATUS_REGISTER status)
+{
+   return status.gps3dfix ? 3 : status.gps2dfix ? 2 : 0;
+}
+
+int quadrino_gps_events_update(struct quadrino_gps_events *events, STATUS_REGISTER status, ktime_t timestamp)
+{
+   STATUS_REGISTER last = events->last;
+   int edges = 0;
+
+   events->last = status;
+   if (!events->valid) {
+       /* the first update after start only sets the baseline */
+       events->valid = true;
+       return 0;
+   }
+
+   spin_lock(&events->lock);
+   if (quadrino_gps_events_fix(status) != quadrino_gps_events_fix(last)) {
+       quadrino_gps_events_queue(events, QUADRINO_GPS_EVENT_FIX, quadrino_gps_events_fix(status),
+           quadrino_gps_events_fix(last), timestamp);
+       edges++;
+   }
+   if (status.wp_reached != last.wp_reached) {
+       quadrino_gps_events_queue(events, QUADRINO_GPS_EVENT_WAYPOINT, status.wp_reached, last.wp_reached,
+           timestamp);
+       edges++;
+   }
+   if (status.numsats != last.numsats) {
+       quadrino_gps_events_queue(events, QUADRINO_GPS_EVENT_NUMSATS, status.numsats, last.numsats, timestamp);
+       edges++;
+   }
+   spin_unlock(&events->lock);
+
+   if (edges)
+       wake_up_interruptible(&events->wait);
+   return edges;
+}
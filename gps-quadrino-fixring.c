@@ -0,0 +1,137 @@
+/* Quadrino GPS I2C driver - binary fix ring
+ *
+ * Exposes a memory mapped ring of binary fix records as /dev/gpsfixN so
+ * consumers can read the latest fix without system calls or NMEA parsing.
+ * The layout of the mapping is described in gps-quadrino-uapi.h.
+ *
+ * Copyright (C) 2016 Colin F. MacKenzie <colin@flyingeinstein.com>
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+
+#include "gps-quadrino.h"
+
+#define FIXRING_MIN_RECORDS 16
+#define FIXRING_MAX_RECORDS 65536
+
+static struct quadrino_gps_fixring *to_fixring(struct file *filp)
+{
+   /* misc_open() stores the miscdevice in private_data */
+   return container_of(filp->private_data, struct quadrino_gps_fixring, misc);
+}
+
+static int quadrino_gps_fixring_open(struct inode *inode, struct file *filp)
+{
+   struct quadrino_gps_fixring *ring = to_fixring(filp);
+
+   /* the mapping is read-only, the driver is the only producer */
+   if (filp->f_mode & FMODE_WRITE)
+       return -EPERM;
+
+   atomic_inc(&ring->users);
+   if (ring->open)
+       ring->open(ring);
+   return 0;
+}
+
+static int quadrino_gps_fixring_release(struct inode *inode, struct file *filp)
+{
+   struct quadrino_gps_fixring *ring = to_fixring(filp);
+
+   atomic_dec(&ring->users);
+   if (ring->release)
+       ring->release(ring);
+   return 0;
+}
+
+static int quadrino_gps_fixring_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+   struct quadrino_gps_fixring *ring = to_fixring(filp);
+   unsigned long length = vma->vm_end - vma->vm_start;
+
+   if (vma->vm_flags & VM_WRITE)
+       return -EPERM;
+   if (vma->vm_pgoff || length > ring->size)
+       return -EINVAL;
+
+   vma->vm_flags &= ~VM_MAYWRITE;
+   return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+static const struct file_operations quadrino_gps_fixring_fops = {
+   .owner = THIS_MODULE,
+   .open = quadrino_gps_fixring_open,
+   .release = quadrino_gps_fixring_release,
+   .mmap = quadrino_gps_fixring_mmap,
+   .llseek = noop_llseek,
+};
+
+int quadrino_gps_fixring_init(struct quadrino_gps_fixring *ring, struct device *parent, int index,
+   unsigned int capacity)
+{
+   int result;
+
+   capacity = roundup_pow_of_two(clamp_t(unsigned int, capacity, FIXRING_MIN_RECORDS, FIXRING_MAX_RECORDS));
+
+   /* the header gets a page to itself so records start page aligned */
+   ring->size = PAGE_ALIGN(PAGE_SIZE + capacity * sizeof(struct quadrino_gps_fix_record));
+   ring->mem = vmalloc_user(ring->size);
+   if (!ring->mem)
+       return -ENOMEM;
+
+   ring->header = ring->mem;
+   ring->records = ring->mem + PAGE_SIZE;
+   ring->header->magic = QUADRINO_GPS_FIXRING_MAGIC;
+   ring->header->version = QUADRINO_GPS_FIXRING_VERSION;
+   ring->header->record_size = sizeof(struct quadrino_gps_fix_record);
+   ring->header->capacity = capacity;
+   ring->header->records_offset = PAGE_SIZE;
+   ring->header->head = 0;
+   atomic_set(&ring->users, 0);
+
+   snprintf(ring->name, sizeof(ring->name), "gpsfix%d", index);
+   ring->misc.minor = MISC_DYNAMIC_MINOR;
+   ring->misc.name = ring->name;
+   ring->misc.fops = &quadrino_gps_fixring_fops;
+   ring->misc.parent = parent;
+   ring->misc.mode = 0444;
+
+   result = misc_register(&ring->misc);
+   if (result) {
+       vfree(ring->mem);
+       ring->mem = NULL;
+   }
+   return result;
+}
+
+void quadrino_gps_fixring_cleanup(struct quadrino_gps_fixring *ring)
+{
+   if (!ring->mem)
+       return;
+
+   /* existing mappings hold their own reference to the pages */
+   misc_deregister(&ring->misc);
+   vfree(ring->mem);
+   ring->mem = NULL;
+}
+
+void quadrino_gps_fixring_publish(struct quadrino_gps_fixring *ring, STATUS_REGISTER status,
+   const GPS_COORDINATES *location, const GPS_DETAIL *detail, ktime_t timestamp)
+{
+   struct quadrino_gps_fix_record fix;
+
+   if (!ring->mem)
+       return;
+
+   memset(&fix, 0, sizeof(fix));
+   fix.timestamp_ns = ktime_to_ns(timestamp);
+   fix.location = *location;
+   fix.detail = *detail;
+   fix.status = status;
+   quadrino_gps_fixring_push(ring->header, ring->records, &fix);
+}
@@ -0,0 +1,130 @@
+/* Quadrino GPS I2C driver - PTP clock
+ *
+ * Turns the GPS time of every module update into a clock the host can be
+ * disciplined against without going through NMEA. The time registers are
+ * read in the same burst as the fix, so each update pairs the GPS time
+ * with the midpoint of the transfer that read it, see gpscore_timesync.
+ * The filtered offset to CLOCK_MONOTONIC is published through a seqlock
+ * and, with the ptp_clock module parameter, as a read-only PTP hardware
+ * clock that chrony or phc2sys can use directly. The clock keeps UTC like
+ * the NMEA output, leap_seconds applies to both.
+ *
+ * Copyright (C) 2016 Colin F. MacKenzie <colin@flyingeinstein.com>
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/ptp_clock_kernel.h>
+
+#include "gps-quadrino.h"
+
+static struct quadrino_gps_ptp *to_ptp(struct ptp_clock_info *info)
+{
+   return container_of(info, struct quadrino_gps_ptp, info);
+}
+
+static int quadrino_gps_ptp_gettime(struct ptp_clock_info *info, struct timespec64 *ts)
+{
+   struct quadrino_gps_ptp *ptp = to_ptp(info);
+   unsigned int seq;
+   bool valid;
+   s64 offset, now;
+
+   do {
+       seq = read_seqbegin(&ptp->lock);
+       valid = ptp->valid;
+       offset = ptp->offset;
+       now = ktime_get_ns();
+   } while (read_seqretry(&ptp->lock, seq));
+
+   /* no fix with a known time yet */
+   if (!valid)
+       return -EAGAIN;
+   *ts = ns_to_timespec64(now + offset);
+   return 0;
+}
+
+/* the module time can't be steered, the clock only follows it */
+static int quadrino_gps_ptp_settime(struct ptp_clock_info *info, const struct timespec64 *ts)
+{
+   return -EOPNOTSUPP;
+}
+
+static int quadrino_gps_ptp_adjtime(struct ptp_clock_info *info, s64 delta)
+{
+   return -EOPNOTSUPP;
+}
+
+static int quadrino_gps_ptp_adjfine(struct ptp_clock_info *info, long scaled_ppm)
+{
+   return -EOPNOTSUPP;
+}
+
+static int quadrino_gps_ptp_enable(struct ptp_clock_info *info, struct ptp_clock_request *request, int on)
+{
+   return -EOPNOTSUPP;
+}
+
+static const struct ptp_clock_info quadrino_gps_ptp_info = {
+   .owner = THIS_MODULE,
+   .max_adj = 0,
+   .gettime64 = quadrino_gps_ptp_gettime,
+   .settime64 = quadrino_gps_ptp_settime,
+   .adjtime = quadrino_gps_ptp_adjtime,
+   .adjfine = quadrino_gps_ptp_adjfine,
+   .enable = quadrino_gps_ptp_enable,
+};
+
+void quadrino_gps_ptp_init(struct quadrino_gps_ptp *ptp, int leap_seconds)
+{
+   seqlock_init(&ptp->lock);
+   gpscore_timesync_init(&ptp->sync, leap_seconds);
+   ptp->valid = false;
+   ptp->offset = 0;
+   ptp->clock = NULL;
+}
+
+int quadrino_gps_ptp_register(struct quadrino_gps_ptp *ptp, struct device *parent, int index)
+{
+   struct ptp_clock *clock;
+
+   ptp->info = quadrino_gps_ptp_info;
+   snprintf(ptp->info.name, sizeof(ptp->info.name), "gps_quadrino%d", index);
+
+   /* without reachable PTP support the stub returns NULL */
+   clock = ptp_clock_register(&ptp->info, parent);
+   if (IS_ERR(clock))
+       return PTR_ERR(clock);
+   if (!clock)
+       return -EOPNOTSUPP;
+   ptp->clock = clock;
+   return 0;
+}
+
+void quadrino_gps_ptp_unregister(struct quadrino_gps_ptp *ptp)
+{
+   if (!ptp->clock)
+       return;
+   ptp_clock_unregister(ptp->clock);
+   ptp->clock = NULL;
+}
+
+int quadrino_gps_ptp_index(struct quadrino_gps_ptp *ptp)
+{
+   return ptp->clock ? ptp_clock_index(ptp->clock) : -1;
+}
+
+void quadrino_gps_ptp_sample(struct quadrino_gps_ptp *ptp, STATUS_REGISTER status, const GPS_DETAIL *detail,
+   ktime_t start, ktime_t end)
+{
+   /* the module latched the registers somewhere within the transfer */
+   s64 mid = ktime_to_ns(start) + (ktime_to_ns(ktime_sub(end, start)) >> 1);
+
+   if (gpscore_timesync_sample(&ptp->sync, status, detail, mid) <= 0)
+       return;
+
+   write_seqlock(&ptp->lock);
+   ptp->valid = true;
+   ptp->offset = ptp->sync.offset;
+   write_sequnlock(&ptp->lock);
+}
@@ -0,0 +1,184 @@
+/* Quadrino GPS I2C driver - flight recorder
+ *
+ * Keeps the recent history of module updates and failed transfers in a
+ * preallocated ring so a crash or a flaky bus can be looked at afterwards,
+ * whether or not anyone was reading the GPS at the time. The poll cycle is
+ * the only producer and never waits for a reader: it fills the next slot
+ * and then publishes it by advancing the head. Readers copy the ring out at
+ * open and drop whatever the producer overwrote while they copied, so the
+ * export is one consistent slice of history. The format of the debugfs
+ * recorder file is in gps-quadrino-uapi.h.
+ *
+ * Copyright (C) 2016 Colin F. MacKenzie <colin@flyingeinstein.com>
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/vmalloc.h>
+#include <linux/overflow.h>
+#include <linux/log2.h>
+
+#include "gps-quadrino.h"
+
+#define RECORDER_MIN_RECORDS 64
+#define RECORDER_MAX_RECORDS 65536
+
+/* an export taken at open, the file is the header immediately followed by the records */
+struct quadrino_gps_recorder_export {
+   size_t size;
+   struct quadrino_gps_recorder_header header;
+   struct quadrino_gps_recorder_record records[];
+};
+
+int quadrino_gps_recorder_init(struct quadrino_gps_recorder *rec, unsigned int capacity)
+{
+   rec->head = 0;
+   if (!capacity)
+       return 0;
+
+   capacity = roundup_pow_of_two(clamp_t(unsigned int, capacity, RECORDER_MIN_RECORDS, RECORDER_MAX_RECORDS));
+   rec->records = vzalloc(array_size(capacity, sizeof(*rec->records)));
+   if (!rec->records)
+       return -ENOMEM;
+   rec->capacity = capacity;
+   return 0;
+}
+
+void quadrino_gps_recorder_free(struct quadrino_gps_recorder *rec)
+{
+   vfree(rec->records);
+   rec->records = NULL;
+   rec->capacity = 0;
+}
+
+/* Fill the next slot and publish it, the caller serializes producers. */
+static struct quadrino_gps_recorder_record *quadrino_gps_recorder_next(struct quadrino_gps_recorder *rec)
+{
+   struct quadrino_gps_recorder_record *record = &rec->records[rec->head & (rec->capacity - 1)];
+
+   memset(record, 0, sizeof(*record));
+   return record;
+}
+
+static void quadrino_gps_recorder_commit(struct quadrino_gps_recorder *rec)
+{
+   /* the record is complete before readers can see the new head */
+   smp_store_release(&rec->head, rec->head + 1);
+
+   /* and the new head is visible before the next record overwrites the oldest
+    * slot, pairs with the smp_rmb() in quadrino_gps_recorder_open()
+    */
+   smp_wmb();
+}
+
+void quadrino_gps_recorder_fix(struct quadrino_gps_recorder *rec, STATUS_REGISTER status,
+   const GPS_COORDINATES *location, const GPS_DETAIL *detail, ktime_t timestamp)
+{
+   struct quadrino_gps_recorder_record *record;
+
+   if (!rec->records)
+       return;
+
+   record = quadrino_gps_recorder_next(rec);
+   record->timestamp_ns = ktime_to_ns(timestamp);
+   record->type = QUADRINO_GPS_RECORD_FIX;
+   record->reg = *(u8 *)&status;
+   record->location = *location;
+   record->detail = *detail;
+   quadrino_gps_recorder_commit(rec);
+}
+
+void quadrino_gps_recorder_error(struct quadrino_gps_recorder *rec, u8 type, u8 reg, int error, ktime_t timestamp)
+{
+   struct quadrino_gps_recorder_record *record;
+
+   if (!rec->records)
+       return;
+
+   record = quadrino_gps_recorder_next(rec);
+   record->timestamp_ns = ktime_to_ns(timestamp);
+   record->type = type;
+   record->reg = reg;
+   record->error = clamp_t(int, error, S16_MIN, S16_MAX);
+   quadrino_gps_recorder_commit(rec);
+}
+
+static int quadrino_gps_recorder_open(struct inode *inode, struct file *filp)
+{
+   struct quadrino_gps_recorder *rec = inode->i_private;
+   struct quadrino_gps_recorder_export *export;
+   unsigned long first, last, head, oldest, i;
+   u32 capacity = rec->capacity;
+   u32 count;
+
+   BUILD_BUG_ON(offsetof(struct quadrino_gps_recorder_export, records) !=
+       offsetof(struct quadrino_gps_recorder_export, header) + sizeof(struct quadrino_gps_recorder_header));
+
+   if (!rec->records)
+       return -ENODEV;
+
+   export = vmalloc(struct_size(export, records, capacity));
+   if (!export)
+       return -ENOMEM;
+
+   /* copy everything published so far, the producer keeps going meanwhile */
+   last = smp_load_acquire(&rec->head);
+   first = last - min_t(unsigned long, last, capacity);
+   for (i = first; i != last; i++)
+       export->records[i - first] = rec->records[i & (capacity - 1)];
+
+   /* A slot is only overwritten after the head that retires it, so any
+    * overwrite the copy saw shows in the head read after it. The slot being
+    * filled now and every one reused since the copy started may be torn.
+    */
+   smp_rmb();
+   head = READ_ONCE(rec->head);
+   oldest = head >= capacity ? head - capacity + 1 : 0;
+   if (oldest > first) {
+       oldest = min(oldest, last);
+       memmove(export->records, &export->records[oldest - first], (last - oldest) * sizeof(export->records[0]));
+       first = oldest;
+   }
+   count = last - first;
+
+   export->header.magic = QUADRINO_GPS_RECORDER_MAGIC;
+   export->header.version = QUADRINO_GPS_RECORDER_VERSION;
+   export->header.record_size = sizeof(export->records[0]);
+   export->header.capacity = capacity;
+   export->header.count = count;
+   export->header.total = last;
+   export->size = sizeof(export->header) + count * sizeof(export->records[0]);
+
+   filp->private_data = export;
+   return 0;
+}
+
+static ssize_t quadrino_gps_recorder_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+   struct quadrino_gps_recorder_export *export = filp->private_data;
+
+   return simple_read_from_buffer(buf, count, ppos, &export->header, export->size);
+}
+
+static int quadrino_gps_recorder_release(struct inode *inode, struct file *filp)
+{
+   vfree(filp->private_data);
+   return 0;
+}
+
+static const struct file_operations quadrino_gps_recorder_fops = {
+   .owner = THIS_MODULE,
+   .open = quadrino_gps_recorder_open,
+   .read = quadrino_gps_recorder_read,
+   .release = quadrino_gps_recorder_release,
+   .llseek = default_llseek,
+};
+
+void quadrino_gps_recorder_debugfs_add(struct quadrino_gps_recorder *rec, struct dentry *dir)
+{
+   if (!rec->records || IS_ERR_OR_NULL(dir))
+       return;
+   debugfs_create_file("recorder", 0400, dir, rec, &quadrino_gps_recorder_fops);
+}
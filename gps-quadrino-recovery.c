@@ -0,0 +1,166 @@
+/* Quadrino GPS I2C driver - bus error recovery
+ *
+ * Keeps fixes flowing on a contended or flaky bus without hammering a
+ * module that stopped answering. A failed transfer is first retried right
+ * away, a lost arbitration or a NACK while the module is busy usually
+ * clears within a transfer or two. When the retries fail too the poll
+ * engine backs off exponentially. Once the backoff runs out the bus is
+ * reset with i2c_recover_bus() and the module probed through its version
+ * register. A module that answers again gets its cached configuration and
+ * waypoints written back since it may have restarted, one that doesn't is
+ * tried again at the longest backoff.
+ *
+ * Copyright (C) 2016 Colin F. MacKenzie <colin@flyingeinstein.com>
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/delay.h>
+#include <linux/i2c.h>
+#include <linux/regmap.h>
+
+#include "gps-quadrino.h"
+
+/* pause between the immediate retries of a transfer */
+#define BUS_RETRY_US 200
+
+/* the first backoff in msecs, it doubles with every failed cycle */
+#define BUS_BACKOFF_MIN 10
+
+/* failed cycles before the bus is reset, the backoffs add up to about 600ms */
+#define BUS_RESET_AFTER 7
+
+static const char * const quadrino_gps_bus_states[] = {
+   [QUADRINO_GPS_BUS_OK] = "ok",
+   [QUADRINO_GPS_BUS_BACKOFF] = "backoff",
+   [QUADRINO_GPS_BUS_RESET] = "reset",
+};
+
+const char *quadrino_gps_bus_state_name(enum quadrino_gps_bus_state state)
+{
+   return quadrino_gps_bus_states[state];
+}
+
+static void quadrino_gps_bus_set_state(struct quadrino_gps *gps, enum quadrino_gps_bus_state state)
+{
+   struct quadrino_gps_bus *bus = &gps->bus;
+
+   if (bus->state == state)
+       return;
+   bus->state = state;
+   bus->since = ktime_get();
+}
+
+void quadrino_gps_bus_init(struct quadrino_gps_bus *bus, unsigned int retries, unsigned int backoff_max)
+{
+   bus->state = QUADRINO_GPS_BUS_OK;
+   bus->errors = 0;
+   bus->backoff = 0;
+   bus->retries = retries;
+   bus->backoff_max = max_t(unsigned int, backoff_max, BUS_BACKOFF_MIN);
+   bus->since = 0;
+}
+
+int quadrino_gps_bus_read(struct quadrino_gps *gps, unsigned int reg, void *buf, size_t count)
+{
+   struct quadrino_gps_bus *bus = &gps->bus;
+   unsigned int attempt;
+   int result;
+
+   for (attempt = 0; ; attempt++) {
+       result = regmap_bulk_read(gps->regmap, reg, buf, count);
+       if (result >= 0) {
+           if (attempt)
+               gps->stats.retried_ok++;
+           return result;
+       }
+
+       /* while recovering every cycle is a single probe of the bus */
+       if (attempt >= bus->retries || bus->state != QUADRINO_GPS_BUS_OK || gps->removing)
+           return result;
+       gps->stats.retries++;
+       usleep_range(BUS_RETRY_US, 2 * BUS_RETRY_US);
+   }
+}
+
+void quadrino_gps_bus_ok(struct quadrino_gps *gps)
+{
+   struct quadrino_gps_bus *bus = &gps->bus;
+
+   if (bus->state == QUADRINO_GPS_BUS_OK && !bus->errors)
+       return;
+
+   if (bus->state != QUADRINO_GPS_BUS_OK)
+       dev_info(&gps->client->dev, KBUILD_MODNAME ": bus recovered after %u failed cycles\n", bus->errors);
+   quadrino_gps_bus_set_state(gps, QUADRINO_GPS_BUS_OK);
+   bus->errors = 0;
+   bus->backoff = 0;
+}
+
+/* Reset the bus and check that the module answers with a version. */
+static int quadrino_gps_bus_reset(struct quadrino_gps *gps)
+{
+   struct quadrino_gps_bus *bus = &gps->bus;
+   struct i2c_client *client = gps->client;
+   struct quadrino_gps_stats *stats = &gps->stats;
+   unsigned int version;
+   int result;
+
+   stats->bus_resets++;
+
+   /* adapters without recovery support return an error, the probe below still tells if the module is back */
+   result = i2c_recover_bus(client->adapter);
+   if (result < 0 && result != -EOPNOTSUPP && result != -EBUSY)
+       dev_warn_ratelimited(&client->dev, KBUILD_MODNAME ": bus recovery failed (%d)\n", result);
+
+   result = regmap_read(gps->regmap, I2C_GPS_REG_VERSION, &version);
+   quadrino_gps_recorder_error(&gps->recorder, QUADRINO_GPS_RECORD_RESET, I2C_GPS_REG_VERSION, result, ktime_get());
+   if (result < 0) {
+       stats->reprobe_failures++;
+       stats->failures[I2C_GPS_REG_VERSION]++;
+       return result;
+   }
+   if (bus->version && bus->version != version)
+       dev_info(&client->dev, KBUILD_MODNAME ": module firmware changed from %u to %u\n", bus->version, version);
+   bus->version = version;
+   stats->reprobes++;
+
+   /* the module may have restarted and lost what we wrote, write the cached registers back */
+   regcache_mark_dirty(gps->regmap);
+   result = regcache_sync(gps->regmap);
+   if (result < 0)
+       dev_warn(&client->dev, KBUILD_MODNAME ": couldn't restore module registers (%d)\n", result);
+   return 0;
+}
+
+void quadrino_gps_bus_failed(struct quadrino_gps *gps)
+{
+   struct quadrino_gps_bus *bus = &gps->bus;
+
+   bus->errors++;
+   if (bus->errors < BUS_RESET_AFTER) {
+       quadrino_gps_bus_set_state(gps, QUADRINO_GPS_BUS_BACKOFF);
+       bus->backoff = min_t(unsigned int, BUS_BACKOFF_MIN << (bus->errors - 1), bus->backoff_max);
+       gps->stats.backoffs++;
+       return;
+   }
+
+   quadrino_gps_bus_set_state(gps, QUADRINO_GPS_BUS_RESET);
+   if (quadrino_gps_bus_reset(gps) < 0) {
+       bus->backoff = bus->backoff_max;
+       return;
+   }
+
+   /* the module answered, poll again right away */
+   dev_info(&gps->client->dev, KBUILD_MODNAME ": module answered after a bus reset\n");
+   quadrino_gps_bus_set_state(gps, QUADRINO_GPS_BUS_OK);
+   bus->errors = 0;
+   bus->backoff = 0;
+}
+
+unsigned long quadrino_gps_bus_delay(struct quadrino_gps *gps, unsigned long delay)
+{
+   if (gps->bus.state == QUADRINO_GPS_BUS_OK)
+       return delay;
+   return gps->bus.backoff * USEC_PER_MSEC;
+}
@@ -0,0 +1,450 @@
+/* Quadrino GPS I2C driver - register simulator
+ *
+ * A fake I2C adapter with a simulated Quadrino at address 0x20 so the
+ * driver can be exercised without hardware, in a VM or a container. The
+ * simulated module implements the registers.h map and refreshes the
+ * status, location and detail window from a replayed trace at a
+ * configurable rate. Transfers can be delayed to model bus latency and
+ * fail with NACKs or timeouts at configurable rates, or wedge the bus so
+ * every transfer times out until the driver recovers it.
+ *
+ *   modprobe gps_quadrino_sim rate=2000 nack_ppm=100
+ *   cat track.bin > /dev/gpssim
+ *   modprobe gps_quadrino
+ *
+ * Without a trace the module drives north at 10m/s from a fixed start.
+ *
+ * Copyright (C) 2016 Colin F. MacKenzie <colin@flyingeinstein.com>
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/i2c.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/random.h>
+#include <linux/delay.h>
+#include <asm/unaligned.h>
+
+#include "registers.h"
+#include "gps-quadrino-uapi.h"
+
+#define SIM_ADDRESS 0x20
+#define SIM_FIRMWARE_VERSION 0x10       /* reported in I2C_GPS_REG_VERSION */
+#define SIM_RATE_MAX 20000
+#define SIM_WEEK_TIME (7*8640000)       /* hundredths of a second in a GPS week */
+
+/* trace records copied per lock hold when loading a trace */
+#define SIM_CHUNK 32
+
+static unsigned int rate = 10;
+module_param(rate, uint, 0644);
+MODULE_PARM_DESC(rate, "Module updates per second, 0 pauses the module (default 10)");
+
+static unsigned int latency_us;
+module_param(latency_us, uint, 0644);
+MODULE_PARM_DESC(latency_us, "Delay added to every transfer in usecs (default 0)");
+
+static unsigned int nack_ppm;
+module_param(nack_ppm, uint, 0644);
+MODULE_PARM_DESC(nack_ppm, "Transfers per million that are not acknowledged (default 0)");
+
+static unsigned int timeout_ppm;
+module_param(timeout_ppm, uint, 0644);
+MODULE_PARM_DESC(timeout_ppm, "Transfers per million that time out (default 0)");
+
+static unsigned int timeout_ms = 10;
+module_param(timeout_ms, uint, 0644);
+MODULE_PARM_DESC(timeout_ms, "How long a timed out transfer holds the bus in msecs (default 10)");
+
+static unsigned int stuck_ppm;
+module_param(stuck_ppm, uint, 0644);
+MODULE_PARM_DESC(stuck_ppm, "Transfers per million that leave the bus stuck until it is recovered (default 0)");
+
+static bool retime = true;
+module_param(retime, bool, 0644);
+MODULE_PARM_DESC(retime, "Stamp updates with the simulator's own GPS time so every update is a new epoch (default Y)");
+
+static unsigned int trace_max = 65536;
+module_param(trace_max, uint, 0444);
+MODULE_PARM_DESC(trace_max, "Maximum number of trace records (default 65536)");
+
+struct quadrino_gps_sim {
+   struct i2c_adapter adapter;
+   struct i2c_client *client;
+   struct miscdevice misc;
+   struct hrtimer timer;
+
+   spinlock_t lock;                    /* protects everything below */
+   u8 regs[I2C_GPS_MAX_REGISTER + 1];
+   u8 pointer;                         /* register of the next byte transferred */
+   struct quadrino_gps_sim_record *trace;
+   unsigned int records;
+   unsigned int next;                  /* trace record of the next update */
+   u16 week;                           /* GPS time of the last update when retiming */
+   u32 time;
+
+   unsigned long updates;
+   unsigned long transfers;
+   unsigned long nacks;
+   unsigned long timeouts;
+   unsigned long recoveries;
+   bool stuck;                         /* a slave holds SDA low, see quadrino_gps_sim_recover() */
+};
+
+static struct quadrino_gps_sim *quadrino_gps_sim;
+
+/* the built-in track, heading north at 10m/s */
+static void quadrino_gps_sim_synthesize(struct quadrino_gps_sim *sim, struct quadrino_gps_sim_record *record)
+{
+   memset(record, 0, sizeof(*record));
+   *(u8*)&record->status = I2C_GPS_STATUS_2DFIX | I2C_GPS_STATUS_3DFIX | (9 << 4);
+   record->location.lat = 481173000 + (sim->updates % 100000) * 90;
+   record->location.lon = 115167000;
+   record->detail.ground_speed = 1000;
+   record->detail.altitude = 545;
+   record->detail.week = 1900;
+   record->detail.time = (sim->updates * 10) % SIM_WEEK_TIME;
+}
+
+/* Publish the next module update in the register window. */
+static void quadrino_gps_sim_update(struct quadrino_gps_sim *sim, unsigned int hz)
+{
+   struct quadrino_gps_sim_record record;
+   u8 *regs = sim->regs;
+
+   if (sim->records) {
+       record = sim->trace[sim->next];
+       if (++sim->next >= sim->records)
+           sim->next = 0;
+   } else {
+       quadrino_gps_sim_synthesize(sim, &record);
+   }
+
+   /* above 100Hz time runs faster than real time so updates stay distinct */
+   if (retime) {
+       sim->time += max(1U, 100 / hz);
+       if (sim->time >= SIM_WEEK_TIME) {
+           sim->time -= SIM_WEEK_TIME;
+           sim->week++;
+       }
+       record.detail.week = sim->week;
+       record.detail.time = sim->time;
+   }
+
+   regs[I2C_GPS_STATUS_00] = *(u8*)&record.status | I2C_GPS_STATUS_NEW_DATA;
+   put_unaligned_le32(record.location.lat, &regs[I2C_GPS_LOCATION]);
+   put_unaligned_le32(record.location.lon, &regs[I2C_GPS_LOCATION + 4]);
+   put_unaligned_le16(record.detail.ground_speed, &regs[I2C_GPS_GROUND_SPEED]);
+   put_unaligned_le16(record.detail.altitude, &regs[I2C_GPS_ALTITUDE]);
+   put_unaligned_le16(record.detail.ground_course, &regs[I2C_GPS_GROUND_COURSE]);
+   put_unaligned_le16(record.detail.week, &regs[I2C_GPS_WEEK]);
+   put_unaligned_le32(record.detail.time, &regs[I2C_GPS_TIME]);
+   sim->updates++;
+}
+
+static enum hrtimer_restart quadrino_gps_sim_tick(struct hrtimer *timer)
+{
+   struct quadrino_gps_sim *sim = container_of(timer, struct quadrino_gps_sim, timer);
+   unsigned int r = min(READ_ONCE(rate), (unsigned int)SIM_RATE_MAX);
+
+   if (r) {
+       spin_lock(&sim->lock);
+       quadrino_gps_sim_update(sim, r);
+       spin_unlock(&sim->lock);
+   }
+
+   /* a paused module checks back for a new rate every 100ms */
+   hrtimer_forward_now(timer, r ? ns_to_ktime(NSEC_PER_SEC / r) : ms_to_ktime(100));
+   return HRTIMER_RESTART;
+}
+
+/* Execute a module command, only what changes registers we can read back. */
+static void quadrino_gps_sim_command(struct quadrino_gps_sim *sim, u8 value)
+{
+   unsigned int wp = value >> 4;
+   u8 *regs = sim->regs;
+
+   switch (value & 0x0f) {
+   case I2C_GPS_COMMAND_SET_WP:
+       memcpy(&regs[I2C_GPS_WP0 + wp * I2C_GPS_WP_SIZE], &regs[I2C_GPS_LOCATION], sizeof(GPS_COORDINATES));
+       break;
+   case I2C_GPS_COMMAND_START_NAV:
+       regs[I2C_GPS_WP_REG] = (regs[I2C_GPS_WP_REG] << 4) | wp;
+       break;
+   }
+}
+
+/* Register reads auto-increment like the module's, reading the status clears new_data. */
+static u8 quadrino_gps_sim_read(struct quadrino_gps_sim *sim)
+{
+   unsigned int reg = sim->pointer++;
+   u8 value;
+
+   if (reg > I2C_GPS_MAX_REGISTER)
+       return 0xff;
+   if (reg == I2C_GPS_COMMAND)
+       return 0;
+
+   value = sim->regs[reg];
+   if (reg == I2C_GPS_STATUS_00)
+       sim->regs[reg] &= ~I2C_GPS_STATUS_NEW_DATA;
+   return value;
+}
+
+static void quadrino_gps_sim_write(struct quadrino_gps_sim *sim, u8 value)
+{
+   unsigned int reg = sim->pointer++;
+
+   if (reg == I2C_GPS_COMMAND)
+       quadrino_gps_sim_command(sim, value);
+   else if (reg >= I2C_GPS_CROSSTRACK_GAIN && reg <= I2C_GPS_MAX_REGISTER)
+       sim->regs[reg] = value;
+   /* the read-only window ignores writes */
+}
+
+static int quadrino_gps_sim_xfer(struct i2c_adapter *adapter, struct i2c_msg *msgs, int num)
+{
+   struct quadrino_gps_sim *sim = i2c_get_adapdata(adapter);
+   unsigned int delay = READ_ONCE(latency_us);
+   unsigned int nack = READ_ONCE(nack_ppm);
+   unsigned long flags;
+   u32 dice;
+   int i, j;
+
+   if (delay >= 10)
+       usleep_range(delay, delay + delay / 8);
+   else if (delay)
+       udelay(delay);
+
+   /* a stuck bus times out every transfer until it is clocked free */
+   dice = get_random_u32() % 1000000;
+   if (!READ_ONCE(sim->stuck) && dice < READ_ONCE(stuck_ppm))
+       WRITE_ONCE(sim->stuck, true);
+   if (READ_ONCE(sim->stuck)) {
+       sim->timeouts++;
+       msleep(READ_ONCE(timeout_ms));
+       return -ETIMEDOUT;
+   }
+
+   dice = get_random_u32() % 1000000;
+   if (dice < nack) {
+       sim->nacks++;
+       return -ENXIO;
+   }
+   if (dice < nack + READ_ONCE(timeout_ppm)) {
+       sim->timeouts++;
+       msleep(READ_ONCE(timeout_ms));
+       return -ETIMEDOUT;
+   }
+
+   spin_lock_irqsave(&sim->lock, flags);
+   sim->transfers++;
+   for (i = 0; i < num; i++) {
+       struct i2c_msg *msg = &msgs[i];
+
+       /* nobody else on this bus */
+       if (msg->addr != SIM_ADDRESS) {
+           spin_unlock_irqrestore(&sim->lock, flags);
+           return -ENXIO;
+       }
+
+       if (msg->flags & I2C_M_RD) {
+           for (j = 0; j < msg->len; j++)
+               msg->buf[j] = quadrino_gps_sim_read(sim);
+       } else if (msg->len) {
+           /* the first byte written sets the register pointer */
+           sim->pointer = msg->buf[0];
+           for (j = 1; j < msg->len; j++)
+               quadrino_gps_sim_write(sim, msg->buf[j]);
+       }
+   }
+   spin_unlock_irqrestore(&sim->lock, flags);
+   return num;
+}
+
+static u32 quadrino_gps_sim_functionality(struct i2c_adapter *adapter)
+{
+   return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+}
+
+static const struct i2c_algorithm quadrino_gps_sim_algorithm = {
+   .master_xfer = quadrino_gps_sim_xfer,
+   .functionality = quadrino_gps_sim_functionality,
+};
+
+/* the clock pulses of a bus recovery free a stuck bus */
+static int quadrino_gps_sim_recover(struct i2c_adapter *adapter)
+{
+   struct quadrino_gps_sim *sim = i2c_get_adapdata(adapter);
+
+   sim->recoveries++;
+   WRITE_ONCE(sim->stuck, false);
+   return 0;
+}
+
+static struct i2c_bus_recovery_info quadrino_gps_sim_recovery = {
+   .recover_bus = quadrino_gps_sim_recover,
+};
+
+/*
+ * /dev/gpssim, trace loading
+ */
+static int quadrino_gps_sim_open(struct inode *inode, struct file *filp)
+{
+   struct quadrino_gps_sim *sim = quadrino_gps_sim;
+   unsigned long flags;
+
+   if (filp->f_mode & FMODE_READ)
+       return -EINVAL;
+
+   if (filp->f_flags & O_TRUNC) {
+       spin_lock_irqsave(&sim->lock, flags);
+       sim->records = 0;
+       sim->next = 0;
+       spin_unlock_irqrestore(&sim->lock, flags);
+   }
+   return nonseekable_open(inode, filp);
+}
+
+/* Append whole records to the trace, the replay picks them up right away. */
+static ssize_t quadrino_gps_sim_trace_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
+{
+   struct quadrino_gps_sim *sim = quadrino_gps_sim;
+   struct quadrino_gps_sim_record chunk[SIM_CHUNK];
+   size_t done = 0, n;
+   unsigned long flags;
+
+   if (count % sizeof(chunk[0]))
+       return -EINVAL;
+
+   while (done < count) {
+       n = min(count - done, sizeof(chunk));
+       if (copy_from_user(chunk, buf + done, n))
+           return done ? done : -EFAULT;
+       n /= sizeof(chunk[0]);
+
+       spin_lock_irqsave(&sim->lock, flags);
+       if (sim->records + n > trace_max) {
+           spin_unlock_irqrestore(&sim->lock, flags);
+           return done ? done : -ENOSPC;
+       }
+       memcpy(&sim->trace[sim->records], chunk, n * sizeof(chunk[0]));
+       sim->records += n;
+       spin_unlock_irqrestore(&sim->lock, flags);
+       done += n * sizeof(chunk[0]);
+   }
+   return done;
+}
+
+static const struct file_operations quadrino_gps_sim_fops = {
+   .owner = THIS_MODULE,
+   .open = quadrino_gps_sim_open,
+   .write = quadrino_gps_sim_trace_write,
+   .llseek = no_llseek,
+};
+
+/* simulator counters: updates transfers nacks timeouts trace_records recoveries */
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct quadrino_gps_sim *sim = quadrino_gps_sim;
+
+   return sprintf(buf, "%lu %lu %lu %lu %u %lu\n", sim->updates, sim->transfers, sim->nacks, sim->timeouts,
+       sim->records, sim->recoveries);
+}
+static DEVICE_ATTR_RO(stats);
+
+static struct attribute *quadrino_gps_sim_attrs[] = {
+   &dev_attr_stats.attr,
+   NULL,
+};
+ATTRIBUTE_GROUPS(quadrino_gps_sim);
+
+static int __init quadrino_gps_sim_init(void)
+{
+   struct quadrino_gps_sim *sim;
+   struct i2c_board_info info = { I2C_BOARD_INFO("gps_quadrino", SIM_ADDRESS) };
+   int result;
+
+   sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+   if (!sim)
+       return -ENOMEM;
+
+   sim->trace = vmalloc(array_size(trace_max, sizeof(*sim->trace)));
+   if (!sim->trace) {
+       result = -ENOMEM;
+       goto err_free;
+   }
+   spin_lock_init(&sim->lock);
+   sim->regs[I2C_GPS_REG_VERSION] = SIM_FIRMWARE_VERSION;
+   sim->week = 1900;
+   quadrino_gps_sim = sim;
+
+   sim->misc.minor = MISC_DYNAMIC_MINOR;
+   sim->misc.name = "gpssim";
+   sim->misc.fops = &quadrino_gps_sim_fops;
+   sim->misc.groups = quadrino_gps_sim_groups;
+   sim->misc.mode = 0200;
+   result = misc_register(&sim->misc);
+   if (result)
+       goto err_trace;
+
+   hrtimer_init(&sim->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   sim->timer.function = quadrino_gps_sim_tick;
+   hrtimer_start(&sim->timer, ms_to_ktime(1), HRTIMER_MODE_REL);
+
+   sim->adapter.owner = THIS_MODULE;
+   sim->adapter.class = I2C_CLASS_HWMON;
+   sim->adapter.algo = &quadrino_gps_sim_algorithm;
+   sim->adapter.bus_recovery_info = &quadrino_gps_sim_recovery;
+   strlcpy(sim->adapter.name, "Quadrino GPS simulator", sizeof(sim->adapter.name));
+   i2c_set_adapdata(&sim->adapter, sim);
+   result = i2c_add_adapter(&sim->adapter);
+   if (result)
+       goto err_timer;
+
+   /* the driver binds to it like to a device tree or board file module */
+   sim->client = i2c_new_client_device(&sim->adapter, &info);
+   if (IS_ERR(sim->client)) {
+       result = PTR_ERR(sim->client);
+       goto err_adapter;
+   }
+
+   pr_info(KBUILD_MODNAME ": simulated Quadrino GPS on %s at 0x%02x\n", dev_name(&sim->adapter.dev), SIM_ADDRESS);
+   return 0;
+
+err_adapter:
+   i2c_del_adapter(&sim->adapter);
+err_timer:
+   hrtimer_cancel(&sim->timer);
+   misc_deregister(&sim->misc);
+err_trace:
+   vfree(sim->trace);
+err_free:
+   kfree(sim);
+   quadrino_gps_sim = NULL;
+   return result;
+}
+
+static void __exit quadrino_gps_sim_exit(void)
+{
+   struct quadrino_gps_sim *sim = quadrino_gps_sim;
+
+   i2c_unregister_device(sim->client);
+   i2c_del_adapter(&sim->adapter);
+   hrtimer_cancel(&sim->timer);
+   misc_deregister(&sim->misc);
+   vfree(sim->trace);
+   kfree(sim);
+}
+
+module_init(quadrino_gps_sim_init);
+module_exit(quadrino_gps_sim_exit);
+
+MODULE_AUTHOR("Colin F. MacKenzie <colin@flyingeinstein.com>");
+MODULE_DESCRIPTION("Quadrino GPS I2C register simulator");
+MODULE_LICENSE("GPL");
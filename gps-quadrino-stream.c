@@ -0,0 +1,292 @@
+/* Quadrino GPS I2C driver - shared output stream
+ *
+ * Exposes the formatted sentences as /dev/gpsnmeaN to any number of
+ * readers. Every sentence batch is written once into a byte ring and each
+ * open file keeps its own cursor into it, so consumers don't cost extra bus
+ * traffic or formatting. A reader that falls more than a ring behind skips
+ * ahead to the latest batch and never holds up the producer or the other
+ * readers. Each output format has its own ring, a reader switches between
+ * them with QUADRINO_GPS_IOC_SET_FORMAT.
+ *
+ * Copyright (C) 2016 Colin F. MacKenzie <colin@flyingeinstein.com>
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+
+#include "gps-quadrino.h"
+
+#define STREAM_MIN_SIZE 1024
+#define STREAM_MAX_SIZE (1024*1024)
+
+/* bytes copied out of the ring per spinlock hold */
+#define STREAM_CHUNK 256
+
+/* per-open cursor into the stream */
+struct quadrino_gps_stream_reader {
+   struct quadrino_gps_stream *stream;
+   struct mutex lock;                  /* serializes readers sharing the file */
+   int format;                         /* QUADRINO_GPS_FORMAT_*, selects the ring */
+   u64 pos;                            /* offset in the ring's stream of the next byte to return */
+   char bounce[STREAM_CHUNK];
+};
+
+static bool quadrino_gps_stream_pending(struct quadrino_gps_stream_reader *reader)
+{
+   struct quadrino_gps_stream *stream = reader->stream;
+
+   return READ_ONCE(stream->ring[READ_ONCE(reader->format)].head) != reader->pos || stream->removed;
+}
+
+static int quadrino_gps_stream_open(struct inode *inode, struct file *filp)
+{
+   /* misc_open() stores the miscdevice in private_data */
+   struct quadrino_gps_stream *stream = container_of(filp->private_data, struct quadrino_gps_stream, misc);
+   struct quadrino_gps_stream_reader *reader;
+
+   if (filp->f_mode & FMODE_WRITE)
+       return -EPERM;
+
+   reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+   if (!reader)
+       return -ENOMEM;
+
+   reader->stream = stream;
+   mutex_init(&reader->lock);
+
+   /* new readers start with the next batch so they only see whole sentences */
+   reader->format = QUADRINO_GPS_FORMAT_NMEA;
+   spin_lock(&stream->lock);
+   reader->pos = stream->ring[reader->format].head;
+   spin_unlock(&stream->lock);
+   filp->private_data = reader;
+
+   atomic_inc(&stream->ring[reader->format].users);
+   atomic_inc(&stream->users);
+   if (stream->open)
+       stream->open(stream);
+   return nonseekable_open(inode, filp);
+}
+
+static int quadrino_gps_stream_release(struct inode *inode, struct file *filp)
+{
+   struct quadrino_gps_stream_reader *reader = filp->private_data;
+   struct quadrino_gps_stream *stream = reader->stream;
+
+   atomic_dec(&stream->ring[reader->format].users);
+   kfree(reader);
+   atomic_dec(&stream->users);
+   if (stream->release)
+       stream->release(stream);
+   return 0;
+}
+
+static ssize_t quadrino_gps_stream_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+   struct quadrino_gps_stream_reader *reader = filp->private_data;
+   struct quadrino_gps_stream *stream = reader->stream;
+   struct quadrino_gps_stream_ring *ring;
+   size_t copied = 0, offset, n;
+   int result;
+
+   if (!count)
+       return 0;
+
+   if (mutex_lock_interruptible(&reader->lock))
+       return -ERESTARTSYS;
+
+   while (!quadrino_gps_stream_pending(reader)) {
+       mutex_unlock(&reader->lock);
+       if (filp->f_flags & O_NONBLOCK)
+           return -EAGAIN;
+       result = wait_event_interruptible(stream->wait, quadrino_gps_stream_pending(reader));
+       if (result)
+           return result;
+       if (mutex_lock_interruptible(&reader->lock))
+           return -ERESTARTSYS;
+   }
+
+   /* the format only changes under the reader lock */
+   ring = &stream->ring[reader->format];
+   while (copied < count) {
+       spin_lock(&stream->lock);
+       if (ring->head - reader->pos > stream->size) {
+           /* overrun, the oldest unread bytes are gone so skip to the latest batch */
+           stream->dropped += ring->epoch - reader->pos;
+           reader->pos = ring->epoch;
+       }
+       offset = reader->pos & (stream->size - 1);
+       n = min_t(size_t, ring->head - reader->pos, count - copied);
+       n = min_t(size_t, n, stream->size - offset);
+       n = min_t(size_t, n, STREAM_CHUNK);
+       memcpy(reader->bounce, ring->buf + offset, n);
+       spin_unlock(&stream->lock);
+
+       if (!n)
+           break;
+       if (copy_to_user(buf + copied, reader->bounce, n)) {
+           if (!copied)
+               copied = -EFAULT;
+           break;
+       }
+       reader->pos += n;
+       copied += n;
+   }
+
+   mutex_unlock(&reader->lock);
+   return copied;
+}
+
+static unsigned int quadrino_gps_stream_poll(struct file *filp, poll_table *wait)
+{
+   struct quadrino_gps_stream_reader *reader = filp->private_data;
+   struct quadrino_gps_stream *stream = reader->stream;
+   unsigned int mask = 0;
+
+   poll_wait(filp, &stream->wait, wait);
+   if (READ_ONCE(stream->ring[READ_ONCE(reader->format)].head) != reader->pos)
+       mask |= POLLIN | POLLRDNORM;
+   if (stream->removed)
+       mask |= POLLHUP;
+   return mask;
+}
+
+/* Switch the reader to another ring, it continues with the next batch of that format. */
+static int quadrino_gps_stream_set_format(struct quadrino_gps_stream_reader *reader, int format)
+{
+   struct quadrino_gps_stream *stream = reader->stream;
+
+   if (format < 0 || format >= QUADRINO_GPS_FORMAT_COUNT)
+       return -EINVAL;
+
+   if (mutex_lock_interruptible(&reader->lock))
+       return -ERESTARTSYS;
+   if (format != reader->format) {
+       atomic_inc(&stream->ring[format].users);
+       atomic_dec(&stream->ring[reader->format].users);
+       spin_lock(&stream->lock);
+       WRITE_ONCE(reader->format, format);
+       reader->pos = stream->ring[format].head;
+       spin_unlock(&stream->lock);
+   }
+   mutex_unlock(&reader->lock);
+   return 0;
+}
+
+static long quadrino_gps_stream_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+   struct quadrino_gps_stream_reader *reader = filp->private_data;
+   struct quadrino_gps_stream *stream = reader->stream;
+   int format;
+
+   /* the format is per open file, everything else is up to the driver */
+   switch (cmd) {
+   case QUADRINO_GPS_IOC_SET_FORMAT:
+       if (get_user(format, (int __user *)arg))
+           return -EFAULT;
+       return quadrino_gps_stream_set_format(reader, format);
+   case QUADRINO_GPS_IOC_GET_FORMAT:
+       return put_user(READ_ONCE(reader->format), (int __user *)arg);
+   }
+
+   if (!stream->ioctl)
+       return -ENOTTY;
+   return stream->ioctl(stream, cmd, arg);
+}
+
+static const struct file_operations quadrino_gps_stream_fops = {
+   .owner = THIS_MODULE,
+   .open = quadrino_gps_stream_open,
+   .release = quadrino_gps_stream_release,
+   .read = quadrino_gps_stream_read,
+   .poll = quadrino_gps_stream_poll,
+   .unlocked_ioctl = quadrino_gps_stream_ioctl,
+   .compat_ioctl = quadrino_gps_stream_ioctl,
+   .llseek = no_llseek,
+};
+
+int quadrino_gps_stream_init(struct quadrino_gps_stream *stream, struct device *parent, int index,
+   unsigned int size)
+{
+   struct quadrino_gps_stream_ring *ring;
+   int result, format;
+
+   stream->size = roundup_pow_of_two(clamp_t(unsigned int, size, STREAM_MIN_SIZE, STREAM_MAX_SIZE));
+   for (format = 0; format < QUADRINO_GPS_FORMAT_COUNT; format++) {
+       ring = &stream->ring[format];
+       ring->buf = vmalloc(stream->size);
+       if (!ring->buf) {
+           quadrino_gps_stream_free(stream);
+           return -ENOMEM;
+       }
+       ring->head = 0;
+       ring->epoch = 0;
+       atomic_set(&ring->users, 0);
+   }
+
+   spin_lock_init(&stream->lock);
+   init_waitqueue_head(&stream->wait);
+   stream->dropped = 0;
+   stream->removed = false;
+   atomic_set(&stream->users, 0);
+
+   snprintf(stream->name, sizeof(stream->name), "gpsnmea%d", index);
+   stream->misc.minor = MISC_DYNAMIC_MINOR;
+   stream->misc.name = stream->name;
+   stream->misc.fops = &quadrino_gps_stream_fops;
+   stream->misc.parent = parent;
+   stream->misc.mode = 0444;
+
+   result = misc_register(&stream->misc);
+   if (result)
+       quadrino_gps_stream_free(stream);
+   return result;
+}
+
+void quadrino_gps_stream_cleanup(struct quadrino_gps_stream *stream)
+{
+   if (!stream->ring[QUADRINO_GPS_FORMAT_NMEA].buf)
+       return;
+
+   /* no new readers, open ones drain what is left and then see EOF */
+   misc_deregister(&stream->misc);
+   stream->removed = true;
+   wake_up_interruptible(&stream->wait);
+}
+
+void quadrino_gps_stream_free(struct quadrino_gps_stream *stream)
+{
+   int format;
+
+   /* only once the last reader released, see quadrino_gps_port_destruct() */
+   for (format = 0; format < QUADRINO_GPS_FORMAT_COUNT; format++) {
+       vfree(stream->ring[format].buf);
+       stream->ring[format].buf = NULL;
+   }
+}
+
+void quadrino_gps_stream_publish(struct quadrino_gps_stream *stream, int format, const char *data, size_t len)
+{
+   struct quadrino_gps_stream_ring *ring = &stream->ring[format];
+   size_t offset, n;
+
+   if (!ring->buf || !len || len > stream->size)
+       return;
+
+   spin_lock(&stream->lock);
+   offset = ring->head & (stream->size - 1);
+   n = min(len, stream->size - offset);
+   memcpy(ring->buf + offset, data, n);
+   memcpy(ring->buf, data + n, len - n);
+   ring->epoch = ring->head;
+   ring->head += len;
+   spin_unlock(&stream->lock);
+
+   wake_up_interruptible(&stream->wait);
+}
@@ -0,0 +1,109 @@
+/* Quadrino GPS I2C driver - tracepoints
+ *
+ * Static tracepoints along the read, format and push pipeline of a poll
+ * cycle, enable them through /sys/kernel/tracing/events/gps_quadrino/ or
+ * attach perf/bpftrace to them.
+ *
+ * Copyright (C) 2016 Colin F. MacKenzie <colin@flyingeinstein.com>
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gps_quadrino
+
+#if !defined(__QUADRINO_GPS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __QUADRINO_GPS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(gps_quadrino_status_start,
+   TP_PROTO(int index),
+   TP_ARGS(index),
+   TP_STRUCT__entry(
+       __field(int, index)
+   ),
+   TP_fast_assign(
+       __entry->index = index;
+   ),
+   TP_printk("gps%d", __entry->index)
+);
+
+TRACE_EVENT(gps_quadrino_status_end,
+   TP_PROTO(int index, int result, u8 status),
+   TP_ARGS(index, result, status),
+   TP_STRUCT__entry(
+       __field(int, index)
+       __field(int, result)
+       __field(u8, status)
+   ),
+   TP_fast_assign(
+       __entry->index = index;
+       __entry->result = result;
+       __entry->status = status;
+   ),
+   TP_printk("gps%d result=%d status=0x%02x new_data=%d fix=%s sats=%u", __entry->index,
+       __entry->result, __entry->status, __entry->status & 0x01,
+       __entry->status & 0x04 ? "3d" : __entry->status & 0x02 ? "2d" : "none",
+       __entry->status >> 4)
+);
+
+/* burst read of the status, location and detail registers */
+TRACE_EVENT(gps_quadrino_block_read,
+   TP_PROTO(int index, u8 reg, u16 len, int result),
+   TP_ARGS(index, reg, len, result),
+   TP_STRUCT__entry(
+       __field(int, index)
+       __field(u8, reg)
+       __field(u16, len)
+       __field(int, result)
+   ),
+   TP_fast_assign(
+       __entry->index = index;
+       __entry->reg = reg;
+       __entry->len = len;
+       __entry->result = result;
+   ),
+   TP_printk("gps%d reg=%u len=%u result=%d", __entry->index, __entry->reg, __entry->len,
+       __entry->result)
+);
+
+/* one formatted sentence, len is the byte count or a negative errno */
+TRACE_EVENT(gps_quadrino_format,
+   TP_PROTO(int index, const char *sentence, int len),
+   TP_ARGS(index, sentence, len),
+   TP_STRUCT__entry(
+       __field(int, index)
+       __string(sentence, sentence)
+       __field(int, len)
+   ),
+   TP_fast_assign(
+       __entry->index = index;
+       __assign_str(sentence, sentence);
+       __entry->len = len;
+   ),
+   TP_printk("gps%d %s len=%d", __entry->index, __get_str(sentence), __entry->len)
+);
+
+/* a sentence batch handed to the tty, dropped bytes had no room in the flip buffer */
+TRACE_EVENT(gps_quadrino_push,
+   TP_PROTO(int index, int bytes, int dropped),
+   TP_ARGS(index, bytes, dropped),
+   TP_STRUCT__entry(
+       __field(int, index)
+       __field(int, bytes)
+       __field(int, dropped)
+   ),
+   TP_fast_assign(
+       __entry->index = index;
+       __entry->bytes = bytes;
+       __entry->dropped = dropped;
+   ),
+   TP_printk("gps%d bytes=%d dropped=%d", __entry->index, __entry->bytes, __entry->dropped)
+);
+
+#endif // __QUADRINO_GPS_TRACE_H
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gps-quadrino-trace
+#include <trace/define_trace.h>
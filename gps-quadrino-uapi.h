@@ -0,0 +1,274 @@
+/* Quadrino GPS driver userspace interface
+ *
+ * Definitions shared between the kernel driver and userspace consumers of
+ * the driver's character devices. Like registers.h this header compiles in
+ * both kernel and userspace.
+ *
+ * Copyright (C) 2016 Colin F. MacKenzie <colin@flyingeinstein.com>
+ */
+#ifndef __QUADRINO_GPS_UAPI_H
+#define __QUADRINO_GPS_UAPI_H
+
+#include "registers.h"
+
+#include <linux/ioctl.h>
+
+#if defined(__KERNEL__)
+#include <linux/compiler.h>
+#include <asm/barrier.h>
+#define qgps_load_acquire(p)        smp_load_acquire(p)
+#define qgps_store_release(p, v)    smp_store_release(p, v)
+#define qgps_read_once(x)           READ_ONCE(x)
+#define qgps_write_once(x, v)       WRITE_ONCE(x, v)
+#define qgps_wmb()                  smp_wmb()
+#define qgps_rmb()                  smp_rmb()
+#else
+#define qgps_load_acquire(p)        __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define qgps_store_release(p, v)    __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define qgps_read_once(x)           __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define qgps_write_once(x, v)       __atomic_store_n(&(x), v, __ATOMIC_RELAXED)
+#define qgps_wmb()                  __atomic_thread_fence(__ATOMIC_RELEASE)
+#define qgps_rmb()                  __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Binary fix ring (/dev/gpsfixN)
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// The device maps read-only into the consumer as a header followed by a ring of fixed-size fix records. The driver
+// is the only producer. Consumers need no system calls to read a fix, they follow the header's head sequence number
+// and validate each record they copy using the record's sequence number.
+//
+#define QUADRINO_GPS_FIXRING_MAGIC          0x53504751      // "QGPS"
+#define QUADRINO_GPS_FIXRING_VERSION        1
+
+struct quadrino_gps_fixring_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;       // sizeof(struct quadrino_gps_fix_record)
+    uint32_t capacity;          // number of records in the ring, always a power of two
+    uint32_t records_offset;    // offset of the first record from the start of the mapping
+    uint32_t head;              // sequence number of the next record to be written
+    uint32_t reserved[3];
+};
+
+struct quadrino_gps_fix_record {
+    uint32_t seq;               // sequence number, ~seq while the record is being written
+    uint32_t flags;             // reserved, zero
+    int64_t  timestamp_ns;      // CLOCK_MONOTONIC time the registers were read
+    GPS_COORDINATES location;
+    GPS_DETAIL detail;
+    STATUS_REGISTER status;
+    uint8_t  reserved[3];
+};
+
+/// \brief Returns the sequence number of the next record to be written, the latest record is head-1.
+static inline uint32_t quadrino_gps_fixring_head(const struct quadrino_gps_fixring_header *header)
+{
+    return qgps_load_acquire(&header->head);
+}
+
+/// \brief Appends a record to the ring, the record's seq field is set by this function.
+/// Only one producer may call this at a time.
+static inline void quadrino_gps_fixring_push(struct quadrino_gps_fixring_header *header,
+                                             struct quadrino_gps_fix_record *records,
+                                             const struct quadrino_gps_fix_record *fix)
+{
+    uint32_t seq = header->head;
+    struct quadrino_gps_fix_record *slot = &records[seq & (header->capacity - 1)];
+
+    qgps_write_once(slot->seq, ~seq);
+    qgps_wmb();
+    slot->flags = fix->flags;
+    slot->timestamp_ns = fix->timestamp_ns;
+    slot->location = fix->location;
+    slot->detail = fix->detail;
+    slot->status = fix->status;
+    qgps_wmb();
+    qgps_write_once(slot->seq, seq);
+    qgps_store_release(&header->head, seq + 1);
+}
+
+/// \brief Copies the record with sequence number seq out of the ring.
+/// \returns 0 on success, or -1 if the record has been overwritten by the producer or was not written yet.
+static inline int quadrino_gps_fixring_read(const struct quadrino_gps_fixring_header *header,
+                                            const struct quadrino_gps_fix_record *records,
+                                            uint32_t seq, struct quadrino_gps_fix_record *fix)
+{
+    const struct quadrino_gps_fix_record *slot = &records[seq & (header->capacity - 1)];
+
+    if (qgps_read_once(slot->seq) != seq)
+        return -1;
+    qgps_rmb();
+    fix->flags = slot->flags;
+    fix->timestamp_ns = slot->timestamp_ns;
+    fix->location = slot->location;
+    fix->detail = slot->detail;
+    fix->status = slot->status;
+    qgps_rmb();
+    if (qgps_read_once(slot->seq) != seq)
+        return -1;
+    fix->seq = seq;
+    return 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Latest fix snapshot
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// The decoded registers of the most recent read cycle. Fetch it with QUADRINO_GPS_IOC_GET_FIX on /dev/ttyGPSN or
+// /dev/gpsnmeaN, or as text from the fix sysfs attribute of the i2c device. The snapshot is only refreshed while
+// some consumer keeps the device polling, check timestamp_ns for its age.
+//
+struct quadrino_gps_fix {
+    uint32_t seq;               // number of read cycles published, 0 if there was none yet
+    uint8_t  status;            // I2C_GPS_STATUS_* bits, new_data is always clear
+    uint8_t  fix;               // 0 no fix, 2 2D fix, 3 3D fix
+    uint8_t  numsats;
+    uint8_t  reserved;
+    int64_t  timestamp_ns;      // CLOCK_MONOTONIC time the registers were read
+    int32_t  lat;               // degree*10 000 000
+    int32_t  lon;               // degree*10 000 000
+    uint16_t altitude;          // meters
+    uint16_t ground_speed;      // cm/s
+    uint16_t ground_course;     // degree*10
+    uint16_t week;              // GPS week
+    uint32_t time;              // 1/100th seconds since the start of the GPS week
+    uint32_t reserved2;         // pads the struct to the same size on 32 and 64 bit ABIs
+};
+
+#define QUADRINO_GPS_IOC_MAGIC              'q'
+#define QUADRINO_GPS_IOC_GET_FIX            _IOR(QUADRINO_GPS_IOC_MAGIC, 1, struct quadrino_gps_fix)
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Output format
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// /dev/ttyGPSN and /dev/gpsnmeaN output NMEA sentences by default. QUADRINO_GPS_IOC_SET_FORMAT switches them to
+// binary fix records instead, one per module update, see binrec.h for an encoder and decoder. The stream device
+// keeps the format per open file. The tty keeps it until its last close, put it in raw mode (cfmakeraw) so the line
+// discipline passes the records through untouched.
+//
+#define QUADRINO_GPS_FORMAT_NMEA            0
+#define QUADRINO_GPS_FORMAT_BINARY          1
+
+#define QUADRINO_GPS_IOC_SET_FORMAT         _IOW(QUADRINO_GPS_IOC_MAGIC, 2, int)
+#define QUADRINO_GPS_IOC_GET_FORMAT         _IOR(QUADRINO_GPS_IOC_MAGIC, 3, int)
+
+// Binary fix record wire format, all fields little-endian:
+//
+//   offset  size
+//        0     2  sync 'Q' 'B'
+//        2     1  version
+//        3     1  record size in bytes
+//        4     4  seq, the fix snapshot sequence number
+//        8     8  timestamp_ns, CLOCK_MONOTONIC time the registers were read
+//       16     8  GPS_COORDINATES lat, lon
+//       24    12  GPS_DETAIL ground_speed, altitude, ground_course, week, time
+//       36     1  STATUS_REGISTER, new_data is always clear
+//       37     1  flags, QUADRINO_GPS_FIX_* bits
+//       38     2  CRC-16/CCITT of bytes 0..37, initial value 0xffff
+//
+#define QUADRINO_GPS_BINREC_SYNC0           0x51            // 'Q'
+#define QUADRINO_GPS_BINREC_SYNC1           0x42            // 'B'
+#define QUADRINO_GPS_BINREC_VERSION         1
+#define QUADRINO_GPS_BINREC_SIZE            40
+
+// the position was extrapolated from the last fix by dead reckoning, GGA reports it with fix quality 6
+#define QUADRINO_GPS_FIX_ESTIMATED          0x01
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Status events
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// /dev/gpseventN reports edges of the fix state, waypoint reached flag and satellite count as they are read, so a
+// supervisor can sleep in poll() or on SIGIO (O_ASYNC) instead of parsing every sentence. read() returns whole
+// records, blocking until one is queued unless the file is O_NONBLOCK. Each open file queues up to
+// QUADRINO_GPS_EVENT_QUEUE records, when a reader falls behind the oldest are dropped and the next record counts
+// them in lost. Only changes are reported, fetch the current state with QUADRINO_GPS_IOC_GET_FIX on the same file.
+//
+#define QUADRINO_GPS_EVENT_FIX              1               // value is 0 no fix, 2 2D fix, 3 3D fix
+#define QUADRINO_GPS_EVENT_WAYPOINT         2               // value is 1 once the active waypoint is reached
+#define QUADRINO_GPS_EVENT_NUMSATS          3               // value is the number of satellites
+
+#define QUADRINO_GPS_EVENT_MASK(type)       (1u << (type))
+#define QUADRINO_GPS_EVENT_ALL              (QUADRINO_GPS_EVENT_MASK(QUADRINO_GPS_EVENT_FIX) | \
+                                             QUADRINO_GPS_EVENT_MASK(QUADRINO_GPS_EVENT_WAYPOINT) | \
+                                             QUADRINO_GPS_EVENT_MASK(QUADRINO_GPS_EVENT_NUMSATS))
+
+#define QUADRINO_GPS_EVENT_QUEUE            64
+
+struct quadrino_gps_event {
+    int64_t  timestamp_ns;      // CLOCK_MONOTONIC time the registers were read
+    uint16_t type;              // QUADRINO_GPS_EVENT_*
+    uint8_t  value;             // state after the edge
+    uint8_t  previous;          // state before the edge
+    uint32_t lost;              // records dropped before this one because the queue was full
+};
+
+typedef char quadrino_gps_event_size_check[(sizeof(struct quadrino_gps_event) == 16) ? 1 : -1];
+
+// selects the QUADRINO_GPS_EVENT_MASK() bits queued for this open file, all of them by default
+#define QUADRINO_GPS_IOC_SET_EVENTS         _IOW(QUADRINO_GPS_IOC_MAGIC, 4, int)
+#define QUADRINO_GPS_IOC_GET_EVENTS         _IOR(QUADRINO_GPS_IOC_MAGIC, 5, int)
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Flight recorder export
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// With the recorder_size module parameter set the driver keeps polling without any consumer and records every
+// module update and failed transfer in a preallocated ring. Reading /sys/kernel/debug/gps_quadrino/<i2c device>/
+// recorder returns one header followed by the recorded history, oldest first. The history is snapshotted at open
+// so a single read of the whole file, e.g. with cp, gives a consistent export while recording goes on.
+//
+#define QUADRINO_GPS_RECORDER_MAGIC         0x52464751      // "QGFR"
+#define QUADRINO_GPS_RECORDER_VERSION       1
+
+#define QUADRINO_GPS_RECORD_FIX             1               // a module update, status, location and detail are set
+#define QUADRINO_GPS_RECORD_ERROR           2               // a failed transfer, reg and error are set
+#define QUADRINO_GPS_RECORD_RESET           3               // a bus reset, error is the result of probing the module
+
+struct quadrino_gps_recorder_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;       // sizeof(struct quadrino_gps_recorder_record)
+    uint32_t capacity;          // records the ring holds
+    uint32_t count;             // records following the header
+    uint64_t total;             // records written since the recorder started, total - count were overwritten
+};
+
+struct quadrino_gps_recorder_record {
+    int64_t  timestamp_ns;      // CLOCK_MONOTONIC time of the read
+    uint8_t  type;              // QUADRINO_GPS_RECORD_*
+    uint8_t  reg;               // fix: the status register, error: start register of the failed transfer
+    int16_t  error;             // negative errno, 0 for fixes
+    GPS_COORDINATES location;
+    GPS_DETAIL detail;
+};
+
+typedef char quadrino_gps_recorder_header_size_check[(sizeof(struct quadrino_gps_recorder_header) == 24) ? 1 : -1];
+typedef char quadrino_gps_recorder_record_size_check[(sizeof(struct quadrino_gps_recorder_record) == 32) ? 1 : -1];
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Register simulator trace (gps_quadrino_sim)
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// The simulator module replays these records through the register window, one per update, looping at the end.
+// Write whole records to /dev/gpssim to append them to the trace, open it with O_TRUNC to start over.
+//
+struct quadrino_gps_sim_record {
+    STATUS_REGISTER status;     // new_data is set by the simulator
+    uint8_t  reserved[3];
+    GPS_COORDINATES location;
+    GPS_DETAIL detail;
+};
+
+typedef char quadrino_gps_sim_record_size_check[(sizeof(struct quadrino_gps_sim_record) == 24) ? 1 : -1];
+
+#endif // __QUADRINO_GPS_UAPI_H
@@ -18,11 +18,30 @@
 #include <linux/tty.h>
 #include <linux/tty_flip.h>
 #include <linux/i2c.h>
+#include <linux/idr.h>
 #include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <uapi/linux/sched/types.h>
+#include <linux/cpumask.h>
+#include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/interrupt.h>
+#include <linux/kfifo.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
 
 #define DEBUG 1
 
 #include "nmea.h"
+#include "binrec.h"
+#include "deadreck.h"
+#include "gpscore.h"
+#include "gps-quadrino.h"
+
+#define CREATE_TRACE_POINTS
+#include "gps-quadrino-trace.h"
 
 /*
  * Version Information
@@ -33,135 +52,1385 @@
 #define QUADRINO_GPS_MAJOR  4
 
 #define QUADRINO_GPS_I2C_ADDRESS 0x20   /* the 7bit I2C address */
-#define QUADRINO_GPS_NUM 1 /* Only support 1 GPS at a time */
+#define QUADRINO_GPS_NUM 8 /* Maximum number of GPS modules, one tty minor each */
+
+/* With a data-ready interrupt polling only serves as a watchdog for missed interrupts */
+#define WATCHDOG_TIME (2*GPSCORE_READ_TIME)
 
-/* By default u-blox GPS fill its buffer every 1 second (1000 msecs) */
-#define READ_TIME 1000
+/* Adaptive polling default (msecs), the limits are shared with the daemon in gpscore.h */
+#define POLL_INTERVAL_DEFAULT 25
 
-// detection of the board we are connected to
-typedef enum {
-    OTHER,
-    GPS_QUADRINO
-} GPSDeviceModel;
+/* Dead reckoning limits, the rate in estimated epochs per second and the
+ * horizon in msecs after the last fix.
+ */
+#define DR_RATE_MAX 100
+#define DR_HORIZON_DEFAULT 1500
+
+/* Bus error recovery limits, see gps-quadrino-recovery.c */
+#define BUS_RETRIES_DEFAULT 2
+#define BUS_RETRIES_MAX 10
+#define BUS_BACKOFF_MAX_DEFAULT 2000
+
+/* status register poll rate in msecs, 0 reverts to a fixed GPSCORE_READ_TIME full read */
+static unsigned int poll_interval = POLL_INTERVAL_DEFAULT;
+module_param(poll_interval, uint, 0444);
+MODULE_PARM_DESC(poll_interval, "Status register poll interval in msecs, 0 disables adaptive polling (default "
+    __stringify(POLL_INTERVAL_DEFAULT) ")");
+
+/* GPS-UTC offset, the Eosbandi firmware passes the receiver's time through unchanged */
+static int leap_seconds;
+module_param(leap_seconds, int, 0444);
+MODULE_PARM_DESC(leap_seconds, "GPS-UTC offset in seconds, use 18 if the module reports GPS time (default 0)");
+
+static unsigned int fixring_size = 256;
+module_param(fixring_size, uint, 0444);
+MODULE_PARM_DESC(fixring_size, "Number of records in the /dev/gpsfix ring, rounded up to a power of two (default 256)");
+
+static unsigned int sentences = NMEA_DEFAULT;
+module_param(sentences, uint, 0444);
+MODULE_PARM_DESC(sentences, "Default NMEA sentence mask, 1=ZDA 2=GGA 4=RMC 8=VTG 16=GSA (default 3)");
+
+static unsigned int dr_rate;
+module_param(dr_rate, uint, 0444);
+MODULE_PARM_DESC(dr_rate, "Dead reckoned epochs per second between module fixes, 0 disables (default 0)");
+
+static unsigned int dr_horizon = DR_HORIZON_DEFAULT;
+module_param(dr_horizon, uint, 0444);
+MODULE_PARM_DESC(dr_horizon, "Msecs after a fix that dead reckoning stops (default " __stringify(DR_HORIZON_DEFAULT) ")");
+
+static unsigned int bus_retries = BUS_RETRIES_DEFAULT;
+module_param(bus_retries, uint, 0444);
+MODULE_PARM_DESC(bus_retries, "Immediate retries of a failed transfer before polling backs off (default "
+    __stringify(BUS_RETRIES_DEFAULT) ")");
+
+static unsigned int bus_backoff_max = BUS_BACKOFF_MAX_DEFAULT;
+module_param(bus_backoff_max, uint, 0444);
+MODULE_PARM_DESC(bus_backoff_max, "Longest poll backoff in msecs while the module doesn't answer (default "
+    __stringify(BUS_BACKOFF_MAX_DEFAULT) ")");
+
+/* history kept for the debugfs recorder file, recording keeps the module polled without consumers */
+static unsigned int recorder_size;
+module_param(recorder_size, uint, 0444);
+MODULE_PARM_DESC(recorder_size, "Flight recorder records per device, rounded up to a power of two, 0 disables (default 0)");
+
+/* GPS time as a PTP hardware clock, like the recorder it keeps the module polled without consumers */
+static bool ptp_clock;
+module_param(ptp_clock, bool, 0444);
+MODULE_PARM_DESC(ptp_clock, "Register a read-only PTP clock following the GPS time (default N)");
+
+static unsigned int stream_size = 8192;
+module_param(stream_size, uint, 0444);
+MODULE_PARM_DESC(stream_size, "Bytes buffered per /dev/gpsnmea reader before it drops, rounded up to a power of two (default 8192)");
+
+/* optional dedicated poll engine, an hrtimer waking a per-device kthread */
+static bool poll_thread;
+module_param(poll_thread, bool, 0444);
+MODULE_PARM_DESC(poll_thread, "Poll from a dedicated hrtimer driven thread instead of the system workqueue (default N)");
+
+static int poll_policy = SCHED_FIFO;
+module_param(poll_policy, int, 0444);
+MODULE_PARM_DESC(poll_policy, "Scheduling policy of the poll thread, 0=normal 1=fifo 2=rr (default 1)");
+
+static int poll_priority = 50;
+module_param(poll_priority, int, 0444);
+MODULE_PARM_DESC(poll_priority, "Real-time priority of the poll thread for fifo/rr policies (default 50)");
+
+static int poll_cpu = -1;
+module_param(poll_cpu, int, 0444);
+MODULE_PARM_DESC(poll_cpu, "CPU the poll thread is bound to, -1 for any (default -1)");
+
+/* data-ready GPIO numbers for boards without a device tree, mainly for testing with gpio-mockup */
+static int data_ready_gpio[QUADRINO_GPS_NUM] = { [0 ... QUADRINO_GPS_NUM-1] = -1 };
+module_param_array(data_ready_gpio, int, NULL, 0444);
+MODULE_PARM_DESC(data_ready_gpio, "Data-ready GPIO number per device when not given by the device tree (default -1, none)");
 
 static const struct of_device_id gps_quadrino_of_match[];   // defined at end of file
 
+static struct tty_driver *quadrino_gps_tty_driver;
+
+/* devices by tty minor, the tty core looks them up when a tty is opened */
+static struct quadrino_gps *quadrino_gps_table[QUADRINO_GPS_NUM];
+static DEFINE_MUTEX(quadrino_gps_table_lock);
+static DEFINE_IDA(quadrino_gps_ida);
+
+
+/* Compute the delay in usecs until the next status poll, see
+ * gpscore_sched_next(). With a data-ready interrupt the poll is only a
+ * watchdog.
+ */
+static unsigned long quadrino_gps_next_poll(struct quadrino_gps *gps, ktime_t now)
+{
+   if (gps->irq > 0)
+       return WATCHDOG_TIME * USEC_PER_MSEC;
+
+   return gpscore_sched_next(&gps->sched, ktime_to_ns(now));
+}
+
+/* Arm the poll engine to run the next cycle after delay usecs. Called with
+ * poll_lock held, which also guards the deadline the jitter is taken from.
+ */
+static void quadrino_gps_schedule(struct quadrino_gps *gps, unsigned long delay)
+{
+   gps->poll_deadline = ktime_add_us(ktime_get(), delay);
+   if (gps->poll_thread) {
+       /* once the thread is being stopped the timer must stay disarmed */
+       if (!gps->poll_stopped)
+           hrtimer_start(&gps->poll_timer, gps->poll_deadline, HRTIMER_MODE_ABS);
+   } else
+       mod_delayed_work(system_wq, &gps->work, usecs_to_jiffies(delay));
+}
+
+/* Account the difference between when a cycle was due and when it ran. */
+static void quadrino_gps_record_jitter(struct quadrino_gps *gps, ktime_t now)
+{
+   struct quadrino_gps_jitter *j = &gps->jitter;
+   s64 late = ktime_to_ns(ktime_sub(now, gps->poll_deadline));
+
+   if (late < 0)
+       late = 0;
+   j->last = late;
+   if (!j->samples || late < j->min)
+       j->min = late;
+   if (late > j->max)
+       j->max = late;
+   j->total += late;
+   j->samples++;
+   quadrino_gps_hist_add(&gps->stats.jitter, late);
+}
 
-static struct tty_port *quadrino_gps_tty_port;
-static struct i2c_client *quadrino_gps_i2c_client;
-static int quadrino_gps_is_open;
-static struct file *quadrino_gps_filp;
+/*
+ * Register map
+ *
+ * Everything up to the end of I2C_GPS_TIME is written by the module and
+ * always read from the bus. The configuration and waypoint registers only
+ * change when we write them so regmap serves them from its cache.
+ */
+static bool quadrino_gps_volatile_reg(struct device *dev, unsigned int reg)
+{
+   return reg < I2C_GPS_CROSSTRACK_GAIN;
+}
 
-struct quadrino_gps_port {
-        struct tty_port port;
-        struct mutex port_write_mutex;
+static bool quadrino_gps_readable_reg(struct device *dev, unsigned int reg)
+{
+   return reg != I2C_GPS_COMMAND;
+}
+
+static bool quadrino_gps_writeable_reg(struct device *dev, unsigned int reg)
+{
+   return reg == I2C_GPS_COMMAND || reg >= I2C_GPS_CROSSTRACK_GAIN;
+}
+
+static const struct regmap_config quadrino_gps_regmap_config = {
+   .reg_bits = 8,
+   .val_bits = 8,
+   .max_register = I2C_GPS_MAX_REGISTER,
+   .volatile_reg = quadrino_gps_volatile_reg,
+   .readable_reg = quadrino_gps_readable_reg,
+   .writeable_reg = quadrino_gps_writeable_reg,
+   .cache_type = REGCACHE_RBTREE,
 };
-static struct quadrino_gps_port gps_port;
 
-static void quadrino_gps_read_worker(struct work_struct *private);
+/* Publish the decoded registers as the latest fix snapshot. Readers never
+ * block the poll cycle, they retry if they raced with this update.
+ */
+static void quadrino_gps_publish_fix(struct quadrino_gps *gps, STATUS_REGISTER status,
+   const GPS_COORDINATES *location, const GPS_DETAIL *detail, ktime_t timestamp)
+{
+   struct quadrino_gps_fix *fix = &gps->fix;
+
+   write_seqlock(&gps->fix_lock);
+   fix->seq++;
+   fix->status = *(u8*)&status & ~I2C_GPS_STATUS_NEW_DATA;
+   fix->fix = status.gps3dfix ? 3 : status.gps2dfix ? 2 : 0;
+   fix->numsats = status.numsats;
+   fix->timestamp_ns = ktime_to_ns(timestamp);
+   fix->lat = location->lat;
+   fix->lon = location->lon;
+   fix->altitude = detail->altitude;
+   fix->ground_speed = detail->ground_speed;
+   fix->ground_course = detail->ground_course;
+   fix->week = detail->week;
+   fix->time = detail->time;
+   write_sequnlock(&gps->fix_lock);
+}
+
+static void quadrino_gps_get_fix(struct quadrino_gps *gps, struct quadrino_gps_fix *fix)
+{
+   unsigned int seq;
 
-static DECLARE_DELAYED_WORK(quadrino_gps_wq, quadrino_gps_read_worker);
+   do {
+       seq = read_seqbegin(&gps->fix_lock);
+       *fix = gps->fix;
+   } while (read_seqretry(&gps->fix_lock, seq));
+}
 
-static void quadrino_gps_read_worker(struct work_struct *private)
+/* ioctls shared by the tty and the stream device */
+static long quadrino_gps_ioctl(struct quadrino_gps *gps, unsigned int cmd, unsigned long arg)
 {
-   STATUS_REGISTER status;
-   GPS_COORDINATES location; 
+   struct quadrino_gps_fix fix;
+
+   switch (cmd) {
+   case QUADRINO_GPS_IOC_GET_FIX:
+       quadrino_gps_get_fix(gps, &fix);
+       if (copy_to_user((void __user *)arg, &fix, sizeof(fix)))
+           return -EFAULT;
+       return 0;
+   }
+   return -ENOIOCTLCMD;
+}
+
+/* sentence mask bits in output order, the names are used for tracing and sysfs */
+static const struct {
+   const char *name;
+   unsigned int bit;
+} quadrino_gps_sentences[] = {
+   { "GPZDA", NMEA_ZDA },
+   { "GPGGA", NMEA_GGA },
+   { "GPRMC", NMEA_RMC },
+   { "GPVTG", NMEA_VTG },
+   { "GPGSA", NMEA_GSA },
+};
+
+/* true if the tty or a stream reader wants the given QUADRINO_GPS_FORMAT_* */
+static bool quadrino_gps_wants(struct quadrino_gps *gps, int format)
+{
+   return (gps->is_open && READ_ONCE(gps->tty_format) == format) ||
+       quadrino_gps_stream_wants(&gps->stream, format);
+}
+
+/* Hand one batch to the tty and the stream readers of its format in one
+ * push, so every reader wakes once per fix.
+ */
+static void quadrino_gps_push(struct quadrino_gps *gps, int format, const char *out, int size)
+{
+   struct quadrino_gps_stats *stats = &gps->stats;
+   int len;
+
+   if (quadrino_gps_stream_wants(&gps->stream, format)) {
+       quadrino_gps_stream_publish(&gps->stream, format, out, size);
+       stats->stream_bytes += size;
+   }
+   if (gps->is_open && READ_ONCE(gps->tty_format) == format) {
+       len = tty_insert_flip_string(&gps->port, out, size);
+       tty_flip_buffer_push(&gps->port);
+       trace_gps_quadrino_push(gps->index, len, size - len);
+       stats->tty_bytes += len;
+       stats->tty_dropped += size - len;
+   }
+}
+
+/* Format the selected sentences of an epoch into the output buffer. All
+ * sentences share one decoded snapshot and one time conversion. This is
+ * gpscore_format() split per sentence for the format tracepoint.
+ */
+static void quadrino_gps_output_nmea(struct quadrino_gps *gps, STATUS_REGISTER status,
+   const GPS_COORDINATES *location, const GPS_DETAIL *detail, bool estimated)
+{
+   struct quadrino_gps_stats *stats = &gps->stats;
+   char *out = gps->output;
+   unsigned int mask = READ_ONCE(gps->sentences);
+   nmea_epoch epoch;
+   ktime_t start;
+   int i, len, size = 0;
+
+   epoch.status = status;
+   epoch.location = *location;
+   epoch.detail = *detail;
+   epoch.estimated = estimated;
+   mask = gpscore_sentences(mask, &epoch);
+   if (!mask)
+       return;
+
+   // convert the time once for all sentences
+   start = ktime_get();
+   gps_clock_convert(&gps->clock, detail, &epoch.broken);
+
+   // format the batch once, every tty and stream reader shares it
+   for (i = 0; i < ARRAY_SIZE(quadrino_gps_sentences); i++) {
+       if (!(mask & quadrino_gps_sentences[i].bit))
+           continue;
+       len = nmea_sentences(out + size, QUADRINO_GPS_OUTPUT_SIZE - size, quadrino_gps_sentences[i].bit, &epoch);
+       trace_gps_quadrino_format(gps->index, quadrino_gps_sentences[i].name, len);
+       if (len > 0)
+           size += len;
+   }
+
+   quadrino_gps_hist_add(&stats->format_time, ktime_to_ns(ktime_sub(ktime_get(), start)));
+   if (size)
+       quadrino_gps_push(gps, QUADRINO_GPS_FORMAT_NMEA, out, size);
+}
+
+/* Encode the epoch as one binary fix record, see binrec.h. Unlike NMEA a
+ * record goes out for every module update, fix or not.
+ */
+static void quadrino_gps_output_binary(struct quadrino_gps *gps, STATUS_REGISTER status,
+   const GPS_COORDINATES *location, const GPS_DETAIL *detail, ktime_t timestamp, bool estimated)
+{
+   struct quadrino_gps_fix_record record;
+   u8 out[QUADRINO_GPS_BINREC_SIZE];
+   int len;
+
+   record.seq = gps->fix.seq;
+   record.flags = estimated ? QUADRINO_GPS_FIX_ESTIMATED : 0;
+   record.timestamp_ns = ktime_to_ns(timestamp);
+   record.location = *location;
+   record.detail = *detail;
+   record.status = status;
+   record.status.new_data = 0;
+
+   len = binrec_encode(out, sizeof(out), &record);
+   trace_gps_quadrino_format(gps->index, "BINARY", len);
+   if (len > 0)
+       quadrino_gps_push(gps, QUADRINO_GPS_FORMAT_BINARY, out, len);
+}
+
+static void quadrino_gps_output(struct quadrino_gps *gps, STATUS_REGISTER status,
+   const GPS_COORDINATES *location, const GPS_DETAIL *detail, ktime_t timestamp, bool estimated)
+{
+   if (!gps->is_open && !quadrino_gps_stream_active(&gps->stream)) {
+       gps->stats.unread++;
+       return;
+   }
+
+   if (quadrino_gps_wants(gps, QUADRINO_GPS_FORMAT_NMEA))
+       quadrino_gps_output_nmea(gps, status, location, detail, estimated);
+   if (quadrino_gps_wants(gps, QUADRINO_GPS_FORMAT_BINARY))
+       quadrino_gps_output_binary(gps, status, location, detail, timestamp, estimated);
+}
+
+/* Make a real fix the base of the following estimates. Without a fix there
+ * is no speed or course to go on.
+ */
+static void quadrino_gps_dr_base(struct quadrino_gps *gps, STATUS_REGISTER status,
+   const GPS_COORDINATES *location, const GPS_DETAIL *detail, ktime_t timestamp)
+{
+   struct quadrino_gps_dr *dr = &gps->dr;
+   unsigned int rate = READ_ONCE(gps->dr_rate);
+
+   dr->valid = rate && (status.gps2dfix || status.gps3dfix);
+   if (!dr->valid)
+       return;
+
+   dr->status = status;
+   dr->location = *location;
+   dr->detail = *detail;
+   dr->timestamp = timestamp;
+   dr->next = ktime_add_ns(timestamp, NSEC_PER_SEC / rate);
+}
+
+/* Output a dead reckoned epoch if one is due. Estimates stop once the base
+ * fix is older than the horizon, the next real fix restarts them.
+ */
+static void quadrino_gps_dr_output(struct quadrino_gps *gps, ktime_t now)
+{
+   struct quadrino_gps_dr *dr = &gps->dr;
+   unsigned int rate = READ_ONCE(gps->dr_rate);
+   GPS_COORDINATES location;
    GPS_DETAIL detail;
+   s64 age;
 
-   char sout[256];
-   s32 gps_buf_size, buf_size = 0;
+   if (!dr->valid || ktime_before(now, dr->next))
+       return;
 
-   if (!quadrino_gps_is_open)
+   age = ktime_ms_delta(now, dr->timestamp);
+   if (!rate || age > READ_ONCE(gps->dr_horizon) ||
+       deadreck_predict(&dr->location, &dr->detail, (u32)age, &location, &detail)) {
+       dr->valid = false;
        return;
+   }
 
-   /* check if driver was removed */
-   if (!quadrino_gps_i2c_client)
+   /* an engine running late skips estimates rather than bunching them up */
+   dr->next = ktime_add_ns(dr->next, NSEC_PER_SEC / rate);
+   if (!ktime_after(dr->next, now))
+       dr->next = ktime_add_ns(now, NSEC_PER_SEC / rate);
+
+   if (!gps->is_open && !quadrino_gps_stream_active(&gps->stream))
        return;
 
-   // read gps status
-   gps_buf_size = i2c_smbus_read_word_data(quadrino_gps_i2c_client, I2C_GPS_STATUS_00);
-   if (gps_buf_size < 0) {
-       dev_warn(&quadrino_gps_i2c_client->dev, KBUILD_MODNAME ": couldn't read status from GPS.\n");
-       /* try one more time */
+   gps->stats.estimates++;
+   quadrino_gps_output(gps, dr->status, &location, &detail, now, true);
+}
+
+/* Shorten the delay until the next cycle to the next estimated epoch. */
+static unsigned long quadrino_gps_dr_delay(struct quadrino_gps *gps, ktime_t now, unsigned long delay)
+{
+   s64 until;
+
+   if (!gps->dr.valid)
+       return delay;
+
+   until = ktime_us_delta(gps->dr.next, now);
+   if (until < 0)
+       until = 0;
+   return min_t(u64, delay, until);
+}
+
+/* Run one poll cycle. Returns the delay in usecs until the next cycle, or
+ * a negative value if the engine should stop because nobody is listening
+ * or the device is being removed. When data_ready is set the module has
+ * signalled new data so the status poll is skipped.
+ */
+static long __quadrino_gps_poll(struct quadrino_gps *gps, bool data_ready)
+{
+   struct i2c_client *client = gps->client;
+   STATUS_REGISTER status;
+   nmea_epoch fix;
+   GPS_REGISTERS *regs;
+   ktime_t timestamp, start, now;
+   unsigned long delay;
+   u8 value;
+   int result;
+   struct quadrino_gps_stats *stats = &gps->stats;
+
+   if (!atomic_read(&gps->consumers))
+       return -ENODEV;
+
+   /* check if driver was removed */
+   if (gps->removing)
+       return -ENODEV;
+
+   stats->cycles++;
+   now = ktime_get();
+   if (data_ready)
+       gpscore_sched_learn(&gps->sched, ktime_to_ns(now));
+   else
+       quadrino_gps_record_jitter(gps, now);
+
+   // a cycle woken only for an estimated epoch stays off the bus
+   quadrino_gps_dr_output(gps, now);
+   if (!data_ready && ktime_before(now, gps->bus_due))
+       return quadrino_gps_dr_delay(gps, now, ktime_us_delta(gps->bus_due, now));
+
+   // in adaptive (or watchdog) mode only the cheap status word is read until the module flags a new update
+   if (!data_ready && (gps->sched.poll_interval || gps->irq > 0)) {
+       trace_gps_quadrino_status_start(gps->index);
+       start = ktime_get();
+       result = quadrino_gps_bus_read(gps, I2C_GPS_STATUS_00, &value, 1);
+       trace_gps_quadrino_status_end(gps->index, result, result < 0 ? 0 : value);
+       quadrino_gps_hist_add(&stats->status_latency, ktime_to_ns(ktime_sub(ktime_get(), start)));
+       if (result < 0) {
+           stats->failures[I2C_GPS_STATUS_00]++;
+           dev_warn_ratelimited(&client->dev, KBUILD_MODNAME ": couldn't read status from GPS (%d)\n", result);
+           quadrino_gps_recorder_error(&gps->recorder, QUADRINO_GPS_RECORD_ERROR, I2C_GPS_STATUS_00, result, start);
+           quadrino_gps_bus_failed(gps);
+           goto end;
+       }
+       quadrino_gps_bus_ok(gps);
+       *(u8*)&status = value;
+       if (!status.new_data)
+           goto end;
+       gpscore_sched_learn(&gps->sched, ktime_get_ns());
+   }
+
+   // read status, location and detail from the same module update in one transfer
+   regs = &gps->shadow->regs;
+   start = ktime_get();
+   result = quadrino_gps_bus_read(gps, I2C_GPS_STATUS_00, regs, sizeof(*regs));
+   timestamp = ktime_get();
+   trace_gps_quadrino_block_read(gps->index, I2C_GPS_STATUS_00, sizeof(*regs), result);
+   quadrino_gps_hist_add(&stats->burst_latency, ktime_to_ns(ktime_sub(timestamp, start)));
+   if (result < 0) {
+       stats->failures[I2C_GPS_STATUS_00]++;
+       dev_warn_ratelimited(&client->dev, KBUILD_MODNAME ": couldn't read registers from GPS (%d)\n", result);
+       quadrino_gps_recorder_error(&gps->recorder, QUADRINO_GPS_RECORD_ERROR, I2C_GPS_STATUS_00, result, start);
+       quadrino_gps_bus_failed(gps);
        goto end;
    }
-   status = *(STATUS_REGISTER*)&gps_buf_size;   // alias the return value as gps status
+   quadrino_gps_bus_ok(gps);
+   stats->updates++;
+   gpscore_decode(regs, &fix);
 
-   if(status.gps2dfix || status.gps3dfix) {
-       // read the current time from the device 
-       gps_buf_size = i2c_smbus_read_i2c_block_data(quadrino_gps_i2c_client, I2C_GPS_GROUND_SPEED, sizeof(GPS_DETAIL), (u8*)&detail);
-       if (gps_buf_size < 0) {
-           dev_warn(&quadrino_gps_i2c_client->dev, KBUILD_MODNAME ": couldn't read gps detail from GPS.\n");
-           goto end;
+   // the data-ready and fixed rate paths can read the same module update twice
+   if (!gpscore_epoch_new(&gps->last_epoch, fix.status, &fix.detail)) {
+       stats->duplicates++;
+       goto end;
+   }
+
+   quadrino_gps_publish_fix(gps, fix.status, &fix.location, &fix.detail, timestamp);
+   quadrino_gps_recorder_fix(&gps->recorder, fix.status, &fix.location, &fix.detail, timestamp);
+   quadrino_gps_ptp_sample(&gps->ptp, fix.status, &fix.detail, start, timestamp);
+   quadrino_gps_fixring_publish(&gps->fixring, fix.status, &fix.location, &fix.detail, timestamp);
+   quadrino_gps_dr_base(gps, fix.status, &fix.location, &fix.detail, timestamp);
+   stats->events += quadrino_gps_events_update(&gps->events, fix.status, timestamp);
+   quadrino_gps_output(gps, fix.status, &fix.location, &fix.detail, timestamp, false);
+end:
+   now = ktime_get();
+   delay = quadrino_gps_bus_delay(gps, quadrino_gps_next_poll(gps, now));
+   gps->bus_due = ktime_add_us(now, delay);
+   return quadrino_gps_dr_delay(gps, now, delay);
+}
+
+/* Run one cycle and arm the next, a negative delay means the worker stops. */
+static void quadrino_gps_poll(struct quadrino_gps *gps, bool data_ready)
+{
+   long delay;
+
+   /* the poll engine and the data-ready irq thread share the device */
+   mutex_lock(&gps->poll_lock);
+   delay = __quadrino_gps_poll(gps, data_ready);
+   if (delay >= 0)
+       quadrino_gps_schedule(gps, delay);
+   mutex_unlock(&gps->poll_lock);
+}
+
+static void quadrino_gps_read_worker(struct work_struct *work)
+{
+   struct quadrino_gps *gps = container_of(to_delayed_work(work), struct quadrino_gps, work);
+
+   /* resubmits the work unless the last consumer is gone */
+   quadrino_gps_poll(gps, false);
+}
+
+/* Issue queued module commands. */
+static void quadrino_gps_command_worker(struct work_struct *work)
+{
+   struct quadrino_gps *gps = container_of(work, struct quadrino_gps, command_work);
+   unsigned int wp;
+   u8 command;
+   int result;
+
+   while (!gps->removing &&
+       kfifo_out_spinlocked(&gps->command_fifo, &command, 1, &gps->command_lock)) {
+       mutex_lock(&gps->poll_lock);
+       result = regmap_write(gps->regmap, I2C_GPS_COMMAND, command);
+       if (result >= 0 && (command & ~I2C_GPS_COMMAND_WP_MASK) == I2C_GPS_COMMAND_SET_WP) {
+           /* the module copied its position into the waypoint, our cached copy is stale */
+           wp = command >> 4;
+           regcache_drop_region(gps->regmap, I2C_GPS_WP0 + wp * I2C_GPS_WP_SIZE,
+               I2C_GPS_WP0 + (wp + 1) * I2C_GPS_WP_SIZE - 1);
        }
+       mutex_unlock(&gps->poll_lock);
 
-       gps_buf_size = i2c_smbus_read_i2c_block_data(quadrino_gps_i2c_client, I2C_GPS_LOCATION, 8, (u8*)&location);
-       if (gps_buf_size < 0) {
-           dev_warn(&quadrino_gps_i2c_client->dev, KBUILD_MODNAME ": couldn't read location from GPS.\n");
-           goto end;
+       if (result < 0) {
+           gps->stats.failures[I2C_GPS_COMMAND]++;
+           dev_warn_ratelimited(&gps->client->dev, KBUILD_MODNAME ": command 0x%02x failed (%d)\n",
+               command, result);
        }
-   } else {
-       // no fix
-       memset(&detail, 0, sizeof(detail));
-       memset(&location, 0, sizeof(location));
    }
+}
 
+/*
+ * Dedicated poll engine
+ *
+ * The hrtimer only wakes the poll thread, the I2C transfers happen in the
+ * thread so they can sleep. The thread can be given a real-time policy and
+ * bound to a CPU for deterministic sampling.
+ */
+static enum hrtimer_restart quadrino_gps_poll_timer(struct hrtimer *timer)
+{
+   struct quadrino_gps *gps = container_of(timer, struct quadrino_gps, poll_timer);
 
-   buf_size = nmea_zda(sout, sizeof(sout), &detail);
-   if(buf_size >0) {
-      tty_insert_flip_string(quadrino_gps_tty_port, sout, buf_size);
+   atomic_set(&gps->poll_due, 1);
+   wake_up_process(gps->poll_thread);
+   return HRTIMER_NORESTART;
+}
+
+static int quadrino_gps_poll_threadfn(void *data)
+{
+   struct quadrino_gps *gps = data;
+
+   for (;;) {
+       set_current_state(TASK_INTERRUPTIBLE);
+       if (kthread_should_stop())
+           break;
+       if (!atomic_xchg(&gps->poll_due, 0)) {
+           schedule();
+           continue;
+       }
+       __set_current_state(TASK_RUNNING);
+       quadrino_gps_poll(gps, false);
    }
+   __set_current_state(TASK_RUNNING);
+   return 0;
+}
 
-   // format and output nmea GPGGA sentence
-   buf_size = nmea_gga(sout, sizeof(sout), &status, &location, &detail);
-   if(buf_size >0) { 
-       tty_insert_flip_string(quadrino_gps_tty_port, sout, buf_size);
-       tty_flip_buffer_push(quadrino_gps_tty_port);
+/*
+ * Data-ready interrupt
+ *
+ * The module raises its data-ready line after every update. The threaded
+ * handler reads and publishes the update right away, then pushes the
+ * watchdog poll out so the poll engine stays idle while interrupts arrive.
+ */
+static irqreturn_t quadrino_gps_irq_thread(int irq, void *data)
+{
+   struct quadrino_gps *gps = data;
+
+   gps->irq_count++;
+   quadrino_gps_poll(gps, true);
+   return IRQ_HANDLED;
+}
+
+/* Find the data-ready interrupt: a data-ready-gpios property, an interrupts
+ * property, or the data_ready_gpio module parameter, in that order.
+ * Returns 0 when the module has no data-ready line and must be polled.
+ */
+static int quadrino_gps_irq_init(struct quadrino_gps *gps)
+{
+   struct device *dev = &gps->client->dev;
+   unsigned long flags = IRQF_ONESHOT;
+   struct gpio_desc *gpio;
+   int gpio_num = data_ready_gpio[gps->index];
+   int irq, result;
+
+   gpio = devm_gpiod_get_optional(dev, "data-ready", GPIOD_IN);
+   if (IS_ERR(gpio))
+       return PTR_ERR(gpio);
+
+   if (!gpio && gps->client->irq <= 0 && gpio_num >= 0) {
+       result = devm_gpio_request_one(dev, gpio_num, GPIOF_IN, "gps-data-ready");
+       if (result)
+           return result;
+       gpio = gpio_to_desc(gpio_num);
    }
-end:
-   /* resubmit the workqueue again */
-   schedule_delayed_work(&quadrino_gps_wq, msecs_to_jiffies(READ_TIME)); /* 1 sec delay */
+
+   if (gpio) {
+       irq = gpiod_to_irq(gpio);
+       if (irq < 0)
+           return irq;
+       flags |= IRQF_TRIGGER_RISING;
+   } else if (gps->client->irq > 0) {
+       /* trigger type comes from the interrupts property */
+       irq = gps->client->irq;
+   } else
+       return 0;
+
+   result = request_threaded_irq(irq, NULL, quadrino_gps_irq_thread, flags, "gps_quadrino", gps);
+   if (result)
+       return result;
+
+   gps->irq = irq;
+   dev_info(dev, KBUILD_MODNAME ": using data-ready interrupt %d, polling as watchdog only\n", irq);
+   return 0;
 }
 
-static int quadrino_gps_serial_open(struct tty_struct *tty, struct file *filp)
+static int quadrino_gps_poll_thread_start(struct quadrino_gps *gps)
+{
+   struct sched_param param = { .sched_priority = 0 };
+   struct task_struct *thread;
+   int result;
+
+   hrtimer_init(&gps->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+   gps->poll_timer.function = quadrino_gps_poll_timer;
+   atomic_set(&gps->poll_due, 0);
+   gps->poll_stopped = false;
+
+   thread = kthread_create(quadrino_gps_poll_threadfn, gps, "gps_quadrino%d", gps->index);
+   if (IS_ERR(thread))
+       return PTR_ERR(thread);
+
+   if (poll_policy == SCHED_FIFO || poll_policy == SCHED_RR)
+       param.sched_priority = clamp(poll_priority, 1, MAX_RT_PRIO - 1);
+   result = sched_setscheduler_nocheck(thread, poll_policy, &param);
+   if (result)
+       dev_warn(&gps->client->dev, KBUILD_MODNAME ": couldn't set poll thread policy %d (%d)\n",
+           poll_policy, result);
+
+   if (poll_cpu >= 0) {
+       if (poll_cpu < nr_cpu_ids && cpu_online(poll_cpu))
+           kthread_bind(thread, poll_cpu);
+       else
+           dev_warn(&gps->client->dev, KBUILD_MODNAME ": poll_cpu %d is not online\n", poll_cpu);
+   }
+
+   gps->poll_thread = thread;
+   wake_up_process(thread);
+   return 0;
+}
+
+static void quadrino_gps_poll_thread_stop(struct quadrino_gps *gps)
+{
+   if (!gps->poll_thread)
+       return;
+
+   /* nothing rearms the timer after this, so once it is cancelled it can't
+    * wake the thread after kthread_stop() returned
+    */
+   mutex_lock(&gps->poll_lock);
+   gps->poll_stopped = true;
+   mutex_unlock(&gps->poll_lock);
+   hrtimer_cancel(&gps->poll_timer);
+   kthread_stop(gps->poll_thread);
+   gps->poll_thread = NULL;
+}
+
+/*
+ * sysfs attributes
+ */
+static ssize_t poll_interval_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+
+   return sprintf(buf, "%u\n", gps->sched.poll_interval);
+}
+
+static ssize_t poll_interval_store(struct device *dev, struct device_attribute *attr,
+   const char *buf, size_t count)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+   unsigned int value;
+   int result;
+
+   result = kstrtouint(buf, 0, &value);
+   if (result)
+       return result;
+   if (value > GPSCORE_POLL_INTERVAL_MAX)
+       return -EINVAL;
+
+   mutex_lock(&gps->poll_lock);
+   gpscore_sched_init(&gps->sched, value);
+   mutex_unlock(&gps->poll_lock);
+   return count;
+}
+static DEVICE_ATTR_RW(poll_interval);
+
+static ssize_t update_period_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+
+   return sprintf(buf, "%u\n", gps->sched.update_period);
+}
+static DEVICE_ATTR_RO(update_period);
+
+/* bus recovery state: name, consecutive failed cycles, current backoff in msecs, msecs in the state */
+static ssize_t bus_state_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+   struct quadrino_gps_bus bus;
+
+   mutex_lock(&gps->poll_lock);
+   bus = gps->bus;
+   mutex_unlock(&gps->poll_lock);
+   return sprintf(buf, "%s %u %u %lld\n", quadrino_gps_bus_state_name(bus.state), bus.errors, bus.backoff,
+       bus.since ? ktime_ms_delta(ktime_get(), bus.since) : 0LL);
+}
+static DEVICE_ATTR_RO(bus_state);
+
+/* GPS time source: offset to CLOCK_MONOTONIC in nsecs, samples, steps and the PTP clock index or -1 */
+static ssize_t time_offset_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+   gpscore_timesync sync;
+
+   mutex_lock(&gps->poll_lock);
+   sync = gps->ptp.sync;
+   mutex_unlock(&gps->poll_lock);
+   return sprintf(buf, "%lld %u %u %d\n", sync.valid ? sync.offset : 0LL, sync.samples, sync.steps,
+       quadrino_gps_ptp_index(&gps->ptp));
+}
+static DEVICE_ATTR_RO(time_offset);
+
+/* scheduling jitter of the poll engine in nsecs: last min avg max samples */
+static ssize_t poll_jitter_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+   struct quadrino_gps_jitter j;
+
+   mutex_lock(&gps->poll_lock);
+   j = gps->jitter;
+   mutex_unlock(&gps->poll_lock);
+   return sprintf(buf, "%lld %lld %lld %lld %llu\n", j.last, j.min,
+       j.samples ? div64_s64(j.total, j.samples) : 0, j.max, j.samples);
+}
+
+static ssize_t poll_jitter_store(struct device *dev, struct device_attribute *attr,
+   const char *buf, size_t count)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+
+   /* any write resets the statistics, the poll cycle updates them under poll_lock */
+   mutex_lock(&gps->poll_lock);
+   memset(&gps->jitter, 0, sizeof(gps->jitter));
+   mutex_unlock(&gps->poll_lock);
+   return count;
+}
+static DEVICE_ATTR_RW(poll_jitter);
+
+static ssize_t irq_count_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+
+   return sprintf(buf, "%lu\n", gps->irq_count);
+}
+static DEVICE_ATTR_RO(irq_count);
+
+/* bytes /dev/gpsnmea readers skipped because they fell a whole buffer behind */
+static ssize_t stream_dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+   u64 dropped;
+
+   spin_lock(&gps->stream.lock);
+   dropped = gps->stream.dropped;
+   spin_unlock(&gps->stream.lock);
+   return sprintf(buf, "%llu\n", dropped);
+}
+static DEVICE_ATTR_RO(stream_dropped);
+
+/* latest fix snapshot: seq fix numsats lat lon altitude speed course week time timestamp_ns */
+static ssize_t fix_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+   struct quadrino_gps_fix fix;
+
+   quadrino_gps_get_fix(gps, &fix);
+   return sprintf(buf, "%u %u %u %d %d %u %u %u %u %u %lld\n", fix.seq, fix.fix, fix.numsats,
+       fix.lat, fix.lon, fix.altitude, fix.ground_speed, fix.ground_course, fix.week, fix.time,
+       (long long)fix.timestamp_ns);
+}
+static DEVICE_ATTR_RO(fix);
+
+/* selected NMEA sentences, shown as names in output order */
+static ssize_t sentences_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+   unsigned int mask = READ_ONCE(gps->sentences);
+   ssize_t len = 0;
+   int i;
+
+   for (i = 0; i < ARRAY_SIZE(quadrino_gps_sentences); i++) {
+       if (mask & quadrino_gps_sentences[i].bit)
+           len += sprintf(buf + len, "%s%s", len ? " " : "", quadrino_gps_sentences[i].name + 2);
+   }
+   len += sprintf(buf + len, "\n");
+   return len;
+}
+
+/* accepts a mask number or a list of sentence names like "zda gga rmc" */
+static ssize_t sentences_store(struct device *dev, struct device_attribute *attr,
+   const char *buf, size_t count)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+   unsigned int mask = 0;
+   char text[64], *p, *name;
+   int i;
+
+   if (!kstrtouint(buf, 0, &mask)) {
+       if (mask & ~NMEA_ALL)
+           return -EINVAL;
+       WRITE_ONCE(gps->sentences, mask);
+       return count;
+   }
+
+   if (count >= sizeof(text))
+       return -E2BIG;
+   memcpy(text, buf, count);
+   text[count] = 0;
+
+   p = text;
+   while ((name = strsep(&p, " \t\n,")) != NULL) {
+       if (!*name)
+           continue;
+       for (i = 0; i < ARRAY_SIZE(quadrino_gps_sentences); i++) {
+           if (!strcasecmp(name, quadrino_gps_sentences[i].name + 2) ||
+               !strcasecmp(name, quadrino_gps_sentences[i].name))
+               break;
+       }
+       if (i == ARRAY_SIZE(quadrino_gps_sentences))
+           return -EINVAL;
+       mask |= quadrino_gps_sentences[i].bit;
+   }
+
+   WRITE_ONCE(gps->sentences, mask);
+   return count;
+}
+static DEVICE_ATTR_RW(sentences);
+
+/* dead reckoned epochs per second between fixes, 0 disables */
+static ssize_t dr_rate_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+
+   return sprintf(buf, "%u\n", gps->dr_rate);
+}
+
+static ssize_t dr_rate_store(struct device *dev, struct device_attribute *attr,
+   const char *buf, size_t count)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+   unsigned int value;
+   int result;
+
+   result = kstrtouint(buf, 0, &value);
+   if (result)
+       return result;
+   if (value > DR_RATE_MAX)
+       return -EINVAL;
+
+   /* takes effect with the next fix */
+   WRITE_ONCE(gps->dr_rate, value);
+   return count;
+}
+static DEVICE_ATTR_RW(dr_rate);
+
+/* msecs after a fix that dead reckoning gives up */
+static ssize_t dr_horizon_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+
+   return sprintf(buf, "%u\n", gps->dr_horizon);
+}
+
+static ssize_t dr_horizon_store(struct device *dev, struct device_attribute *attr,
+   const char *buf, size_t count)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+   unsigned int value;
+   int result;
+
+   result = kstrtouint(buf, 0, &value);
+   if (result)
+       return result;
+   if (value > DEADRECK_MAX_HORIZON)
+       return -EINVAL;
+
+   WRITE_ONCE(gps->dr_horizon, value);
+   return count;
+}
+static DEVICE_ATTR_RW(dr_horizon);
+
+/* Read cached registers, misses populate the cache with one bulk read. */
+static int quadrino_gps_read_cached(struct quadrino_gps *gps, unsigned int reg, u8 *buf, size_t count)
+{
+   int result;
+
+   mutex_lock(&gps->poll_lock);
+   result = regmap_bulk_read(gps->regmap, reg, buf, count);
+   if (result < 0)
+       gps->stats.failures[reg]++;
+   mutex_unlock(&gps->poll_lock);
+   return result;
+}
+
+/* Write count bytes at reg through the register cache. Only registers whose
+ * value changes are written to the cache, then the span from the first to
+ * the last changed register goes out in a single sync. Without register
+ * defaults the sync re-sends every cached register in that span, unchanged
+ * ones in between included, so scattered changes still become one block
+ * transfer. Stores the highest changed register in last and returns the
+ * number of changed registers. Called with poll_lock held since cache-only
+ * mode is map wide.
+ */
+static int quadrino_gps_write_cached(struct quadrino_gps *gps, unsigned int reg, const u8 *buf,
+   size_t count, unsigned int *last)
+{
+   u8 cached[I2C_GPS_WP_COUNT * I2C_GPS_WP_SIZE];
+   unsigned int first = 0;
+   size_t i;
+   int result, changed = 0;
+
+   if (count > sizeof(cached))
+       return -EINVAL;
+
+   result = regmap_bulk_read(gps->regmap, reg, cached, count);
+   if (result < 0) {
+       gps->stats.failures[reg]++;
+       return result;
+   }
+
+   regcache_cache_only(gps->regmap, true);
+   for (i = 0; i < count; i++) {
+       if (cached[i] == buf[i])
+           continue;
+       result = regmap_write(gps->regmap, reg + i, buf[i]);
+       if (result < 0)
+           break;
+       if (!changed)
+           first = reg + i;
+       *last = reg + i;
+       changed++;
+   }
+   regcache_cache_only(gps->regmap, false);
+   if (result < 0 || !changed)
+       return result;
+
+   result = regcache_sync_region(gps->regmap, first, *last);
+   if (result < 0) {
+       gps->stats.failures[reg]++;
+       return result;
+   }
+   return changed;
+}
+
+/* Configuration registers I2C_GPS_CROSSTRACK_GAIN..I2C_GPS_NAV_IMAX as a
+ * binary image. Reads come from the register cache once it is populated,
+ * writes update the cache and the span of changed registers goes out in
+ * one sync.
+ */
+static ssize_t config_read(struct file *filp, struct kobject *kobj, struct bin_attribute *attr,
+   char *buf, loff_t off, size_t count)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(kobj_to_dev(kobj));
+   int result;
+
+   result = quadrino_gps_read_cached(gps, I2C_GPS_CROSSTRACK_GAIN + off, buf, count);
+   return result < 0 ? result : count;
+}
+
+static ssize_t config_write(struct file *filp, struct kobject *kobj, struct bin_attribute *attr,
+   char *buf, loff_t off, size_t count)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(kobj_to_dev(kobj));
+   unsigned int last = 0;
+   int result;
+
+   mutex_lock(&gps->poll_lock);
+   result = quadrino_gps_write_cached(gps, I2C_GPS_CROSSTRACK_GAIN + off, buf, count, &last);
+   if (result > 0 && last >= I2C_GPS_HOLD_P) {
+       /* the module only picks up new gains on request */
+       result = regmap_write(gps->regmap, I2C_GPS_COMMAND, I2C_GPS_COMMAND_UPDATE_PIDS);
+   }
+   mutex_unlock(&gps->poll_lock);
+   return result < 0 ? result : count;
+}
+static BIN_ATTR_RW(config, I2C_GPS_CONFIG_SIZE);
+
+/* The waypoint table I2C_GPS_WP0..I2C_GPS_WP15 as an array of GPS_WAYPOINT,
+ * a whole mission uploads in one write and goes out as one bus burst.
+ */
+static ssize_t waypoints_read(struct file *filp, struct kobject *kobj, struct bin_attribute *attr,
+   char *buf, loff_t off, size_t count)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(kobj_to_dev(kobj));
+   int result;
+
+   result = quadrino_gps_read_cached(gps, I2C_GPS_WP0 + off, buf, count);
+   return result < 0 ? result : count;
+}
+
+static ssize_t waypoints_write(struct file *filp, struct kobject *kobj, struct bin_attribute *attr,
+   char *buf, loff_t off, size_t count)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(kobj_to_dev(kobj));
+   unsigned int last;
+   int result;
+
+   mutex_lock(&gps->poll_lock);
+   result = quadrino_gps_write_cached(gps, I2C_GPS_WP0 + off, buf, count, &last);
+   mutex_unlock(&gps->poll_lock);
+   return result < 0 ? result : count;
+}
+static BIN_ATTR_RW(waypoints, I2C_GPS_WP_COUNT * I2C_GPS_WP_SIZE);
+
+/* active and previous waypoint as reported by the module */
+static ssize_t waypoint_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+   unsigned int value;
+   int result;
+
+   /* volatile, a read while a config write holds the map cache-only would fail with -EBUSY */
+   mutex_lock(&gps->poll_lock);
+   result = regmap_read(gps->regmap, I2C_GPS_WP_REG, &value);
+   if (result < 0)
+       gps->stats.failures[I2C_GPS_WP_REG]++;
+   mutex_unlock(&gps->poll_lock);
+   if (result < 0)
+       return result;
+   return sprintf(buf, "%u %u\n", value & I2C_GPS_WP_REG_ACTIVE_MASK,
+       (value & I2C_GPS_WP_REG_PERVIOUS_MASK) >> 4);
+}
+static DEVICE_ATTR_RO(waypoint);
+
+static const struct {
+   const char *name;
+   u8 command;
+   bool wp;                /* takes a waypoint number */
+} quadrino_gps_commands[] = {
+   { "poshold", I2C_GPS_COMMAND_POSHOLD, false },
+   { "start_nav", I2C_GPS_COMMAND_START_NAV, true },
+   { "set_wp", I2C_GPS_COMMAND_SET_WP, true },
+   { "update_pids", I2C_GPS_COMMAND_UPDATE_PIDS, false },
+   { "nav_override", I2C_GPS_COMMAND_NAV_OVERRIDE, false },
+   { "stop_nav", I2C_GPS_COMMAND_STOP_NAV, false },
+};
+
+/* Parse one "name [waypoint]" command into a COMMAND_REGISTER value. */
+static int quadrino_gps_parse_command(char *line, u8 *command)
 {
-   if (quadrino_gps_is_open)
+   char *name = strsep(&line, " \t");
+   unsigned int wp = 0;
+   int i;
+
+   for (i = 0; i < ARRAY_SIZE(quadrino_gps_commands); i++) {
+       if (strcmp(name, quadrino_gps_commands[i].name))
+           continue;
+       if (quadrino_gps_commands[i].wp) {
+           if (!line || kstrtouint(skip_spaces(line), 10, &wp) || wp >= I2C_GPS_WP_COUNT)
+               return -EINVAL;
+       } else if (line && *skip_spaces(line)) {
+           return -EINVAL;
+       }
+       *command = quadrino_gps_commands[i].command | (wp << 4);
+       return 0;
+   }
+   return -EINVAL;
+}
+
+/* Queue module commands, one per line or separated by ';'. The store never
+ * waits on the bus, the command worker issues them in order.
+ */
+static ssize_t command_store(struct device *dev, struct device_attribute *attr,
+   const char *buf, size_t count)
+{
+   struct quadrino_gps *gps = dev_get_drvdata(dev);
+   u8 commands[QUADRINO_GPS_COMMAND_QUEUE];
+   char text[128], *p, *line;
+   unsigned int n = 0;
+   unsigned long flags;
+   int result;
+
+   if (count >= sizeof(text))
+       return -E2BIG;
+   memcpy(text, buf, count);
+   text[count] = 0;
+
+   /* parse everything first so a bad line queues nothing */
+   p = text;
+   while ((line = strsep(&p, "\n;")) != NULL) {
+       line = strim(line);
+       if (!*line)
+           continue;
+       if (n == ARRAY_SIZE(commands))
+           return -E2BIG;
+       result = quadrino_gps_parse_command(line, &commands[n]);
+       if (result)
+           return result;
+       n++;
+   }
+   if (!n)
+       return -EINVAL;
+
+   spin_lock_irqsave(&gps->command_lock, flags);
+   if (kfifo_avail(&gps->command_fifo) < n) {
+       spin_unlock_irqrestore(&gps->command_lock, flags);
        return -EBUSY;
+   }
+   kfifo_in(&gps->command_fifo, commands, n);
+   spin_unlock_irqrestore(&gps->command_lock, flags);
 
-   quadrino_gps_filp = filp;
-   quadrino_gps_tty_port = tty->port;
-   quadrino_gps_tty_port->low_latency = true; /* make sure we push data immediately */
-   quadrino_gps_is_open = true;
+   schedule_work(&gps->command_work);
+   return count;
+}
+static DEVICE_ATTR_WO(command);
+
+static struct attribute *quadrino_gps_attrs[] = {
+   &dev_attr_poll_interval.attr,
+   &dev_attr_update_period.attr,
+   &dev_attr_bus_state.attr,
+   &dev_attr_time_offset.attr,
+   &dev_attr_poll_jitter.attr,
+   &dev_attr_irq_count.attr,
+   &dev_attr_stream_dropped.attr,
+   &dev_attr_waypoint.attr,
+   &dev_attr_fix.attr,
+   &dev_attr_sentences.attr,
+   &dev_attr_dr_rate.attr,
+   &dev_attr_dr_horizon.attr,
+   &dev_attr_command.attr,
+   NULL
+};
 
-   schedule_delayed_work(&quadrino_gps_wq, 0);
+static struct bin_attribute *quadrino_gps_bin_attrs[] = {
+   &bin_attr_config,
+   &bin_attr_waypoints,
+   NULL
+};
 
-   return tty_port_open(&gps_port.port, tty, filp);
+static const struct attribute_group quadrino_gps_attr_group = {
+   .attrs = quadrino_gps_attrs,
+   .bin_attrs = quadrino_gps_bin_attrs,
+};
+
+/* Start the read worker, the first consumer also resets the learned state. */
+static void quadrino_gps_start(struct quadrino_gps *gps, bool first)
+{
+   if (gps->removing)
+       return;
+
+   if (first) {
+       /* a cycle that hasn't noticed the last consumer leave may still be running */
+       mutex_lock(&gps->poll_lock);
+       gpscore_sched_init(&gps->sched, gps->sched.poll_interval);
+       gps->last_epoch.valid = 0;
+       gps->dr.valid = false;
+       gps->events.valid = false;
+       gps->bus_due = 0;
+       quadrino_gps_bus_init(&gps->bus, gps->bus.retries, gps->bus.backoff_max);
+       gps_clock_init(&gps->clock, leap_seconds);
+       mutex_unlock(&gps->poll_lock);
+   }
+
+   mutex_lock(&gps->poll_lock);
+   quadrino_gps_schedule(gps, 0);
+   mutex_unlock(&gps->poll_lock);
+}
+
+/* Every tty, fix ring, stream, event and recorder user shares one read
+ * worker. The worker stops itself on its next cycle once the last consumer
+ * is gone.
+ */
+static void quadrino_gps_consumer_get(struct quadrino_gps *gps)
+{
+   if (atomic_inc_return(&gps->consumers) == 1)
+       quadrino_gps_start(gps, true);
+}
+
+static void quadrino_gps_consumer_put(struct quadrino_gps *gps)
+{
+   atomic_dec(&gps->consumers);
+}
+
+static void quadrino_gps_fixring_open(struct quadrino_gps_fixring *ring)
+{
+   struct quadrino_gps *gps = container_of(ring, struct quadrino_gps, fixring);
+
+   /* an open ring keeps the device struct alive after remove */
+   tty_port_get(&gps->port);
+   quadrino_gps_consumer_get(gps);
+}
+
+static void quadrino_gps_fixring_release(struct quadrino_gps_fixring *ring)
+{
+   struct quadrino_gps *gps = container_of(ring, struct quadrino_gps, fixring);
+
+   quadrino_gps_consumer_put(gps);
+   tty_port_put(&gps->port);
+}
+
+static void quadrino_gps_stream_open(struct quadrino_gps_stream *stream)
+{
+   struct quadrino_gps *gps = container_of(stream, struct quadrino_gps, stream);
+
+   /* like the fix ring, a reader keeps the device struct and stream buffer alive */
+   tty_port_get(&gps->port);
+   quadrino_gps_consumer_get(gps);
+}
+
+static void quadrino_gps_stream_release(struct quadrino_gps_stream *stream)
+{
+   struct quadrino_gps *gps = container_of(stream, struct quadrino_gps, stream);
+
+   quadrino_gps_consumer_put(gps);
+   tty_port_put(&gps->port);
+}
+
+static long quadrino_gps_stream_ioctl(struct quadrino_gps_stream *stream, unsigned int cmd, unsigned long arg)
+{
+   struct quadrino_gps *gps = container_of(stream, struct quadrino_gps, stream);
+   long result = quadrino_gps_ioctl(gps, cmd, arg);
+
+   return result == -ENOIOCTLCMD ? -ENOTTY : result;
+}
+
+static void quadrino_gps_events_open(struct quadrino_gps_events *events)
+{
+   struct quadrino_gps *gps = container_of(events, struct quadrino_gps, events);
+
+   /* like the stream, a reader keeps the device struct alive */
+   tty_port_get(&gps->port);
+   quadrino_gps_consumer_get(gps);
+}
+
+static void quadrino_gps_events_release(struct quadrino_gps_events *events)
+{
+   struct quadrino_gps *gps = container_of(events, struct quadrino_gps, events);
+
+   quadrino_gps_consumer_put(gps);
+   tty_port_put(&gps->port);
+}
+
+static long quadrino_gps_events_ioctl(struct quadrino_gps_events *events, unsigned int cmd, unsigned long arg)
+{
+   struct quadrino_gps *gps = container_of(events, struct quadrino_gps, events);
+   long result = quadrino_gps_ioctl(gps, cmd, arg);
+
+   return result == -ENOIOCTLCMD ? -ENOTTY : result;
+}
+
+static int quadrino_gps_serial_install(struct tty_driver *driver, struct tty_struct *tty)
+{
+   struct quadrino_gps *gps;
+   int result;
+
+   mutex_lock(&quadrino_gps_table_lock);
+   gps = quadrino_gps_table[tty->index];
+   if (gps)
+       tty_port_get(&gps->port);
+   mutex_unlock(&quadrino_gps_table_lock);
+
+   if (!gps)
+       return -ENODEV;
+
+   result = tty_port_install(&gps->port, driver, tty);
+   if (result) {
+       tty_port_put(&gps->port);
+       return result;
+   }
+   tty->driver_data = gps;
+   return 0;
+}
+
+static void quadrino_gps_serial_cleanup(struct tty_struct *tty)
+{
+   struct quadrino_gps *gps = tty->driver_data;
+
+   tty->driver_data = NULL;
+   tty_port_put(&gps->port);
+}
+
+/* the tty port calls activate on the first open and shutdown after the last close */
+static int quadrino_gps_serial_open(struct tty_struct *tty, struct file *filp)
+{
+   struct quadrino_gps *gps = tty->driver_data;
+
+   return tty_port_open(&gps->port, tty, filp);
 }
 
 static void quadrino_gps_serial_close(struct tty_struct *tty, struct file *filp)
 {
-   if (!quadrino_gps_is_open)
-       return;
+   struct quadrino_gps *gps = tty->driver_data;
 
-   /* avoid stop when the denied (in open) file structure closes itself */
-   if (quadrino_gps_filp != filp)
-       return;
+   tty_port_close(&gps->port, tty, filp);
+}
 
-   quadrino_gps_is_open = false;
-   quadrino_gps_filp = NULL;
-   quadrino_gps_tty_port = NULL;
+static int quadrino_gps_serial_ioctl(struct tty_struct *tty, unsigned int cmd, unsigned long arg)
+{
+   struct quadrino_gps *gps = tty->driver_data;
+   int format;
+
+   /* all opens of the tty share its output, so the format is per port */
+   switch (cmd) {
+   case QUADRINO_GPS_IOC_SET_FORMAT:
+       if (get_user(format, (int __user *)arg))
+           return -EFAULT;
+       if (format < 0 || format >= QUADRINO_GPS_FORMAT_COUNT)
+           return -EINVAL;
+       WRITE_ONCE(gps->tty_format, format);
+       return 0;
+   case QUADRINO_GPS_IOC_GET_FORMAT:
+       return put_user(READ_ONCE(gps->tty_format), (int __user *)arg);
+   }
 
-   tty_port_close(&gps_port.port, tty, filp);
+   return quadrino_gps_ioctl(gps, cmd, arg);
+}
+
+static void quadrino_gps_serial_hangup(struct tty_struct *tty)
+{
+   struct quadrino_gps *gps = tty->driver_data;
+
+   tty_port_hangup(&gps->port);
 }
 
 static int quadrino_gps_serial_write(struct tty_struct *tty, const unsigned char *buf,
    int count)
 {
-   if (!quadrino_gps_is_open)
+   struct quadrino_gps *gps = tty->driver_data;
+
+   if (!gps->is_open)
        return 0;
 
    /* check if driver was removed */
-   if (!quadrino_gps_i2c_client)
+   if (gps->removing)
        return 0;
 
    /* we don't write back to the GPS so just return same value here */
@@ -170,11 +1439,13 @@ static int quadrino_gps_serial_write(struct tty_struct *tty, const unsigned char
 
 static int quadrino_gps_write_room(struct tty_struct *tty)
 {
-   if (!quadrino_gps_is_open)
+   struct quadrino_gps *gps = tty->driver_data;
+
+   if (!gps->is_open)
        return 0;
 
    /* check if driver was removed */
-   if (!quadrino_gps_i2c_client)
+   if (gps->removing)
        return 0;
 
    /* we don't write back to the GPS so just return some value here */
@@ -182,15 +1453,54 @@ static int quadrino_gps_write_room(struct tty_struct *tty)
 }
 
 static const struct tty_operations quadrino_gps_serial_ops = {
+   .install = quadrino_gps_serial_install,
+   .cleanup = quadrino_gps_serial_cleanup,
    .open = quadrino_gps_serial_open,
    .close = quadrino_gps_serial_close,
+   .hangup = quadrino_gps_serial_hangup,
+   .ioctl = quadrino_gps_serial_ioctl,
    .write = quadrino_gps_serial_write,
    .write_room = quadrino_gps_write_room,
 };
 
-static struct tty_driver *quadrino_gps_tty_driver;
+static int quadrino_gps_port_activate(struct tty_port *port, struct tty_struct *tty)
+{
+   struct quadrino_gps *gps = container_of(port, struct quadrino_gps, port);
 
-static struct tty_port_operations null_ops = { };
+   /* every first open starts out with NMEA */
+   gps->tty_format = QUADRINO_GPS_FORMAT_NMEA;
+   gps->is_open = true;
+   quadrino_gps_consumer_get(gps);
+   return 0;
+}
+
+static void quadrino_gps_port_shutdown(struct tty_port *port)
+{
+   struct quadrino_gps *gps = container_of(port, struct quadrino_gps, port);
+
+   gps->is_open = false;
+   quadrino_gps_consumer_put(gps);
+}
+
+/* called when the last reference to the port is dropped */
+static void quadrino_gps_port_destruct(struct tty_port *port)
+{
+   struct quadrino_gps *gps = container_of(port, struct quadrino_gps, port);
+
+   cancel_delayed_work_sync(&gps->work);
+   cancel_work_sync(&gps->command_work);
+   quadrino_gps_poll_thread_stop(gps);
+   quadrino_gps_stream_free(&gps->stream);
+   quadrino_gps_recorder_free(&gps->recorder);
+   kfree(gps->shadow);
+   kfree(gps);
+}
+
+static const struct tty_port_operations quadrino_gps_port_ops = {
+   .activate = quadrino_gps_port_activate,
+   .shutdown = quadrino_gps_port_shutdown,
+   .destruct = quadrino_gps_port_destruct,
+};
 
 
 static int quadrino_gps_probe(struct i2c_client *client,
@@ -198,88 +1508,224 @@ static int quadrino_gps_probe(struct i2c_client *client,
 {
    int result = 0;
    const struct of_device_id *of_id;
-   GPSDeviceModel board;
+   struct quadrino_gps *gps;
 
    printk("gps_quadrino: probing devices\n");
-   quadrino_gps_i2c_client = client;
+
+   gps = kzalloc(sizeof(*gps), GFP_KERNEL);
+   if (!gps)
+       return -ENOMEM;
+
+   gps->shadow = kzalloc(sizeof(*gps->shadow), GFP_KERNEL);
+   if (!gps->shadow) {
+       kfree(gps);
+       return -ENOMEM;
+   }
+
+   /* from here on the port refcount owns gps, see quadrino_gps_port_destruct() */
+   tty_port_init(&gps->port);
+   gps->port.ops = &quadrino_gps_port_ops;
+   gps->port.low_latency = true; /* make sure we push data immediately */
+   gps->client = client;
+   INIT_DELAYED_WORK(&gps->work, quadrino_gps_read_worker);
+   INIT_WORK(&gps->command_work, quadrino_gps_command_worker);
+   INIT_KFIFO(gps->command_fifo);
+   spin_lock_init(&gps->command_lock);
+   seqlock_init(&gps->fix_lock);
+   mutex_init(&gps->poll_lock);
+   gpscore_sched_init(&gps->sched, min(poll_interval, (unsigned int)GPSCORE_POLL_INTERVAL_MAX));
+   gps->sentences = sentences & NMEA_ALL;
+   gps->dr_rate = min(dr_rate, (unsigned int)DR_RATE_MAX);
+   gps->dr_horizon = min(dr_horizon, (unsigned int)DEADRECK_MAX_HORIZON);
+   quadrino_gps_bus_init(&gps->bus, min(bus_retries, (unsigned int)BUS_RETRIES_MAX), bus_backoff_max);
+   gps_clock_init(&gps->clock, leap_seconds);
+   quadrino_gps_ptp_init(&gps->ptp, leap_seconds);
+   i2c_set_clientdata(client, gps);
+
+   gps->regmap = devm_regmap_init_i2c(client, &quadrino_gps_regmap_config);
+   if (IS_ERR(gps->regmap)) {
+       result = PTR_ERR(gps->regmap);
+       dev_err(&client->dev, KBUILD_MODNAME ": %s - regmap init failed\n", __func__);
+       goto err;
+   }
 
    // read what Device Tree (DT) config we matched to hardware
    // this can be used to enable/disable features based on being a QuadrinoGPS or generic MultiWii I2C GPS module
-   of_id = of_match_node(gps_quadrino_of_match, quadrino_gps_i2c_client->dev.of_node);
-   board = (GPSDeviceModel)of_id->data;
+   of_id = of_match_node(gps_quadrino_of_match, client->dev.of_node);
+   gps->board = of_id ? (GPSDeviceModel)of_id->data : OTHER;
 
    // based on the DT config we matched inform the user
-   if(board == GPS_QUADRINO)
+   if(gps->board == GPS_QUADRINO)
        printk("gps_quadrino: detected Quadrino GPS\n");
    else
        printk("gps_quadrino: detected generic MultiWii GPS\n");
 
-   mutex_init(&gps_port.port_write_mutex);
+   result = ida_simple_get(&quadrino_gps_ida, 0, QUADRINO_GPS_NUM, GFP_KERNEL);
+   if (result < 0) {
+       dev_err(&client->dev, KBUILD_MODNAME ": %s - no free GPS minor\n", __func__);
+       goto err;
+   }
+   gps->index = result;
 
-   quadrino_gps_tty_driver = tty_alloc_driver(1,
-            TTY_DRIVER_RESET_TERMIOS |
-            TTY_DRIVER_REAL_RAW |
-            TTY_DRIVER_UNNUMBERED_NODE);
-   if (IS_ERR(quadrino_gps_tty_driver))
-            return PTR_ERR(quadrino_gps_tty_driver);
+   if (poll_thread) {
+       result = quadrino_gps_poll_thread_start(gps);
+       if (result) {
+           dev_err(&client->dev, KBUILD_MODNAME ": %s - poll thread failed\n", __func__);
+           goto err_ida;
+       }
+   }
 
-   if (!quadrino_gps_tty_driver)
-       return -ENOMEM;
+   result = quadrino_gps_irq_init(gps);
+   if (result) {
+       dev_err(&client->dev, KBUILD_MODNAME ": %s - data-ready interrupt failed\n", __func__);
+       goto err_thread;
+   }
 
-   tty_port_init(&gps_port.port);
-   gps_port.port.ops = &null_ops;
+   result = sysfs_create_group(&client->dev.kobj, &quadrino_gps_attr_group);
+   if (result) {
+       dev_err(&client->dev, KBUILD_MODNAME ": %s - sysfs_create_group failed\n",
+           __func__);
+       goto err_irq;
+   }
 
-   quadrino_gps_tty_driver->owner = THIS_MODULE;
-   quadrino_gps_tty_driver->driver_name = "gps_quadrino";
-   quadrino_gps_tty_driver->name = "ttyGPS";
-   quadrino_gps_tty_driver->major = QUADRINO_GPS_MAJOR;
-   quadrino_gps_tty_driver->minor_start = 96;
-   quadrino_gps_tty_driver->type = TTY_DRIVER_TYPE_SERIAL;
-   quadrino_gps_tty_driver->subtype = SERIAL_TYPE_NORMAL;
-   quadrino_gps_tty_driver->flags = TTY_DRIVER_REAL_RAW;
-   quadrino_gps_tty_driver->init_termios = tty_std_termios;
-   quadrino_gps_tty_driver->init_termios.c_iflag = IGNCR | IXON;
-   quadrino_gps_tty_driver->init_termios.c_oflag = OPOST;
-   quadrino_gps_tty_driver->init_termios.c_cflag = B9600 | CS8 | CREAD |
-       HUPCL | CLOCAL;
-   quadrino_gps_tty_driver->init_termios.c_ispeed = 9600;
-   quadrino_gps_tty_driver->init_termios.c_ospeed = 9600;
-   tty_set_operations(quadrino_gps_tty_driver, &quadrino_gps_serial_ops);
-   tty_port_link_device(&gps_port.port, quadrino_gps_tty_driver, 0);
-   result = tty_register_driver(quadrino_gps_tty_driver);
+   gps->fixring.open = quadrino_gps_fixring_open;
+   gps->fixring.release = quadrino_gps_fixring_release;
+   result = quadrino_gps_fixring_init(&gps->fixring, &client->dev, gps->index, fixring_size);
    if (result) {
-       dev_err(&quadrino_gps_i2c_client->dev, KBUILD_MODNAME ": %s - tty_register_driver failed\n",
+       dev_err(&client->dev, KBUILD_MODNAME ": %s - fix ring device failed\n",
            __func__);
-       goto err;
+       goto err_sysfs;
+   }
+
+   gps->stream.open = quadrino_gps_stream_open;
+   gps->stream.release = quadrino_gps_stream_release;
+   gps->stream.ioctl = quadrino_gps_stream_ioctl;
+   result = quadrino_gps_stream_init(&gps->stream, &client->dev, gps->index, stream_size);
+   if (result) {
+       dev_err(&client->dev, KBUILD_MODNAME ": %s - nmea stream device failed\n",
+           __func__);
+       goto err_fixring;
    }
 
-   quadrino_gps_filp = NULL;
-   quadrino_gps_tty_port = NULL;
-   quadrino_gps_is_open = false;
+   gps->events.open = quadrino_gps_events_open;
+   gps->events.release = quadrino_gps_events_release;
+   gps->events.ioctl = quadrino_gps_events_ioctl;
+   result = quadrino_gps_events_init(&gps->events, &client->dev, gps->index);
+   if (result) {
+       dev_err(&client->dev, KBUILD_MODNAME ": %s - event device failed\n",
+           __func__);
+       goto err_stream;
+   }
 
-   /* i2c_set_clientdata(client, NULL); */
+   result = quadrino_gps_recorder_init(&gps->recorder, recorder_size);
+   if (result) {
+       dev_err(&client->dev, KBUILD_MODNAME ": %s - flight recorder allocation failed\n",
+           __func__);
+       goto err_events;
+   }
 
-   dev_info(&quadrino_gps_i2c_client->dev, KBUILD_MODNAME ": " DRIVER_VERSION ": "
-       DRIVER_DESC "\n");
+   if (ptp_clock) {
+       result = quadrino_gps_ptp_register(&gps->ptp, &client->dev, gps->index);
+       if (result == -EOPNOTSUPP) {
+           dev_warn(&client->dev, KBUILD_MODNAME ": kernel has no PTP clock support, ptp_clock ignored\n");
+       } else if (result) {
+           dev_err(&client->dev, KBUILD_MODNAME ": %s - PTP clock registration failed\n",
+               __func__);
+           goto err_events;
+       }
+   }
 
-   return result;
+   quadrino_gps_debugfs_add(gps, dev_name(&client->dev));
+   quadrino_gps_recorder_debugfs_add(&gps->recorder, gps->stats.dir);
+
+   mutex_lock(&quadrino_gps_table_lock);
+   quadrino_gps_table[gps->index] = gps;
+   mutex_unlock(&quadrino_gps_table_lock);
+
+   gps->tty_dev = tty_port_register_device(&gps->port, quadrino_gps_tty_driver, gps->index, &client->dev);
+   if (IS_ERR(gps->tty_dev)) {
+       result = PTR_ERR(gps->tty_dev);
+       dev_err(&client->dev, KBUILD_MODNAME ": %s - tty_port_register_device failed\n",
+           __func__);
+       goto err_table;
+   }
+
+   dev_info(&client->dev, KBUILD_MODNAME ": " DRIVER_VERSION ": "
+       DRIVER_DESC " on %s%d\n", quadrino_gps_tty_driver->name, gps->index);
+
+   /* the recorder and the PTP clock are consumers of their own, they follow the GPS whether anyone reads it or not */
+   if (gps->recorder.records)
+       quadrino_gps_consumer_get(gps);
+   if (gps->ptp.clock)
+       quadrino_gps_consumer_get(gps);
 
+   return 0;
+
+err_table:
+   mutex_lock(&quadrino_gps_table_lock);
+   quadrino_gps_table[gps->index] = NULL;
+   mutex_unlock(&quadrino_gps_table_lock);
+   quadrino_gps_debugfs_remove(&gps->stats);
+   quadrino_gps_ptp_unregister(&gps->ptp);
+err_events:
+   quadrino_gps_events_cleanup(&gps->events);
+err_stream:
+   quadrino_gps_stream_cleanup(&gps->stream);
+err_fixring:
+   quadrino_gps_fixring_cleanup(&gps->fixring);
+err_sysfs:
+   sysfs_remove_group(&client->dev.kobj, &quadrino_gps_attr_group);
+err_irq:
+   if (gps->irq > 0)
+       free_irq(gps->irq, gps);
+err_thread:
+   quadrino_gps_poll_thread_stop(gps);
+err_ida:
+   ida_simple_remove(&quadrino_gps_ida, gps->index);
 err:
-   dev_err(&quadrino_gps_i2c_client->dev, KBUILD_MODNAME ": %s - returning with error %d\n",
+   dev_err(&client->dev, KBUILD_MODNAME ": %s - returning with error %d\n",
        __func__, result);
 
-   put_tty_driver(quadrino_gps_tty_driver);
-   tty_port_destroy(&gps_port.port);
+   tty_port_put(&gps->port);
    return result;
 }
 
 static int quadrino_gps_remove(struct i2c_client *client)
 {
-   tty_unregister_driver(quadrino_gps_tty_driver);
-   put_tty_driver(quadrino_gps_tty_driver);
-   tty_port_destroy(&gps_port.port);
-
-   quadrino_gps_i2c_client = NULL;
+   struct quadrino_gps *gps = i2c_get_clientdata(client);
+
+   /* no new opens of the tty */
+   mutex_lock(&quadrino_gps_table_lock);
+   quadrino_gps_table[gps->index] = NULL;
+   mutex_unlock(&quadrino_gps_table_lock);
+
+   /* stop the worker first, it returns without resubmitting once removing is set */
+   gps->removing = true;
+   if (gps->irq > 0)
+       free_irq(gps->irq, gps);
+   cancel_delayed_work_sync(&gps->work);
+   quadrino_gps_poll_thread_stop(gps);
+   if (gps->recorder.records)
+       quadrino_gps_consumer_put(gps);
+   if (gps->ptp.clock)
+       quadrino_gps_consumer_put(gps);
+
+   /* sysfs goes first so no more commands can be queued */
+   sysfs_remove_group(&client->dev.kobj, &quadrino_gps_attr_group);
+   cancel_work_sync(&gps->command_work);
+
+   quadrino_gps_debugfs_remove(&gps->stats);
+   quadrino_gps_ptp_unregister(&gps->ptp);
+   quadrino_gps_events_cleanup(&gps->events);
+   quadrino_gps_stream_cleanup(&gps->stream);
+   quadrino_gps_fixring_cleanup(&gps->fixring);
+
+   tty_port_tty_hangup(&gps->port, false);
+   tty_unregister_device(quadrino_gps_tty_driver, gps->index);
+   ida_simple_remove(&quadrino_gps_ida, gps->index);
+
+   /* open ttys, fix ring, stream and event consumers hold their own reference */
+   tty_port_put(&gps->port);
 
    return 0;
 }
@@ -313,10 +1759,64 @@ static struct i2c_driver quadrino_gps_i2c_driver = {
    .remove    = quadrino_gps_remove,
 };
 
-module_i2c_driver(quadrino_gps_i2c_driver);
+static int __init quadrino_gps_init(void)
+{
+   int result;
+
+   /* one tty driver serves all modules, each probed module registers a minor */
+   quadrino_gps_tty_driver = tty_alloc_driver(QUADRINO_GPS_NUM,
+            TTY_DRIVER_RESET_TERMIOS |
+            TTY_DRIVER_REAL_RAW |
+            TTY_DRIVER_DYNAMIC_DEV);
+   if (IS_ERR(quadrino_gps_tty_driver))
+       return PTR_ERR(quadrino_gps_tty_driver);
+
+   quadrino_gps_tty_driver->owner = THIS_MODULE;
+   quadrino_gps_tty_driver->driver_name = "gps_quadrino";
+   quadrino_gps_tty_driver->name = "ttyGPS";
+   quadrino_gps_tty_driver->major = QUADRINO_GPS_MAJOR;
+   quadrino_gps_tty_driver->minor_start = 96;
+   quadrino_gps_tty_driver->type = TTY_DRIVER_TYPE_SERIAL;
+   quadrino_gps_tty_driver->subtype = SERIAL_TYPE_NORMAL;
+   quadrino_gps_tty_driver->init_termios = tty_std_termios;
+   quadrino_gps_tty_driver->init_termios.c_iflag = IGNCR | IXON;
+   quadrino_gps_tty_driver->init_termios.c_oflag = OPOST;
+   quadrino_gps_tty_driver->init_termios.c_cflag = B9600 | CS8 | CREAD |
+       HUPCL | CLOCAL;
+   quadrino_gps_tty_driver->init_termios.c_ispeed = 9600;
+   quadrino_gps_tty_driver->init_termios.c_ospeed = 9600;
+   tty_set_operations(quadrino_gps_tty_driver, &quadrino_gps_serial_ops);
+
+   result = tty_register_driver(quadrino_gps_tty_driver);
+   if (result) {
+       pr_err(KBUILD_MODNAME ": %s - tty_register_driver failed\n", __func__);
+       put_tty_driver(quadrino_gps_tty_driver);
+       return result;
+   }
+
+   quadrino_gps_debugfs_init();
+
+   result = i2c_add_driver(&quadrino_gps_i2c_driver);
+   if (result) {
+       quadrino_gps_debugfs_exit();
+       tty_unregister_driver(quadrino_gps_tty_driver);
+       put_tty_driver(quadrino_gps_tty_driver);
+   }
+   return result;
+}
+module_init(quadrino_gps_init);
+
+static void __exit quadrino_gps_exit(void)
+{
+   i2c_del_driver(&quadrino_gps_i2c_driver);
+   quadrino_gps_debugfs_exit();
+   tty_unregister_driver(quadrino_gps_tty_driver);
+   put_tty_driver(quadrino_gps_tty_driver);
+   ida_destroy(&quadrino_gps_ida);
+}
+module_exit(quadrino_gps_exit);
 
 MODULE_AUTHOR("Colin F. MacKenzie <colin@flyingeinstein.com>");
 MODULE_DESCRIPTION(DRIVER_DESC);
 MODULE_VERSION(DRIVER_VERSION);
 MODULE_LICENSE("GPL");
-
@@ -0,0 +1,345 @@
+/* Quadrino GPS I2C driver
+ *
+ * Internal definitions shared between the driver's source files.
+ *
+ * Copyright (C) 2016 Colin F. MacKenzie <colin@flyingeinstein.com>
+ */
+#ifndef __QUADRINO_GPS_H
+#define __QUADRINO_GPS_H
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
+#include <linux/tty.h>
+#include <linux/i2c.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/regmap.h>
+#include <linux/kfifo.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/seqlock.h>
+#include <linux/bitops.h>
+#include <linux/ptp_clock_kernel.h>
+
+#include "registers.h"
+#include "nmea.h"
+#include "gpscore.h"
+#include "gps-quadrino-uapi.h"
+
+/*
+ * Binary fix ring, see gps-quadrino-fixring.c
+ */
+struct quadrino_gps_fixring {
+        struct miscdevice misc;
+        char name[16];
+        void *mem;                                      /* vmalloc_user'd mapping shared with userspace */
+        size_t size;
+        struct quadrino_gps_fixring_header *header;
+        struct quadrino_gps_fix_record *records;
+        atomic_t users;
+        /* called for every consumer that opens or releases the ring */
+        void (*open)(struct quadrino_gps_fixring *ring);
+        void (*release)(struct quadrino_gps_fixring *ring);
+};
+
+int quadrino_gps_fixring_init(struct quadrino_gps_fixring *ring, struct device *parent, int index,
+        unsigned int capacity);
+void quadrino_gps_fixring_cleanup(struct quadrino_gps_fixring *ring);
+void quadrino_gps_fixring_publish(struct quadrino_gps_fixring *ring, STATUS_REGISTER status,
+        const GPS_COORDINATES *location, const GPS_DETAIL *detail, ktime_t timestamp);
+
+static inline bool quadrino_gps_fixring_active(struct quadrino_gps_fixring *ring)
+{
+        return atomic_read(&ring->users) > 0;
+}
+
+/*
+ * Shared output stream with per-reader cursors, see gps-quadrino-stream.c
+ */
+#define QUADRINO_GPS_FORMAT_COUNT       2       /* QUADRINO_GPS_FORMAT_* values */
+
+struct quadrino_gps_stream_ring {
+        char *buf;                                      /* byte ring, size is a power of two */
+        u64 head;                                       /* stream offset of the next byte written */
+        u64 epoch;                                      /* stream offset of the latest batch */
+        atomic_t users;                                 /* readers in this format */
+};
+
+struct quadrino_gps_stream {
+        struct miscdevice misc;
+        char name[16];
+        size_t size;                                    /* of every ring */
+        spinlock_t lock;                                /* protects the rings and dropped */
+        struct quadrino_gps_stream_ring ring[QUADRINO_GPS_FORMAT_COUNT];
+        u64 dropped;                                    /* bytes skipped by readers that fell behind */
+        bool removed;                                   /* device is gone, readers see EOF once drained */
+        wait_queue_head_t wait;
+        atomic_t users;
+        /* called for every reader that opens or releases the stream */
+        void (*open)(struct quadrino_gps_stream *stream);
+        void (*release)(struct quadrino_gps_stream *stream);
+        long (*ioctl)(struct quadrino_gps_stream *stream, unsigned int cmd, unsigned long arg);
+};
+
+int quadrino_gps_stream_init(struct quadrino_gps_stream *stream, struct device *parent, int index,
+        unsigned int size);
+void quadrino_gps_stream_cleanup(struct quadrino_gps_stream *stream);
+void quadrino_gps_stream_free(struct quadrino_gps_stream *stream);
+void quadrino_gps_stream_publish(struct quadrino_gps_stream *stream, int format, const char *data, size_t len);
+
+static inline bool quadrino_gps_stream_active(struct quadrino_gps_stream *stream)
+{
+        return atomic_read(&stream->users) > 0;
+}
+
+/* true if some reader wants the given QUADRINO_GPS_FORMAT_* */
+static inline bool quadrino_gps_stream_wants(struct quadrino_gps_stream *stream, int format)
+{
+        return atomic_read(&stream->ring[format].users) > 0;
+}
+
+/*
+ * Status event channel, see gps-quadrino-events.c
+ */
+struct quadrino_gps_events {
+        struct miscdevice misc;
+        char name[16];
+        bool registered;
+        spinlock_t lock;                                /* protects the reader list and their queues */
+        struct list_head readers;
+        wait_queue_head_t wait;
+        bool removed;                                   /* device is gone, readers see EOF */
+        bool valid;                                     /* last holds a baseline to detect edges against */
+        STATUS_REGISTER last;
+
+        /* called for every reader that opens or releases the device */
+        void (*open)(struct quadrino_gps_events *events);
+        void (*release)(struct quadrino_gps_events *events);
+        long (*ioctl)(struct quadrino_gps_events *events, unsigned int cmd, unsigned long arg);
+};
+
+int quadrino_gps_events_init(struct quadrino_gps_events *events, struct device *parent, int index);
+void quadrino_gps_events_cleanup(struct quadrino_gps_events *events);
+int quadrino_gps_events_update(struct quadrino_gps_events *events, STATUS_REGISTER status, ktime_t timestamp);
+
+/*
+ * Bus error recovery, see gps-quadrino-recovery.c
+ */
+enum quadrino_gps_bus_state {
+        QUADRINO_GPS_BUS_OK,                            /* transfers succeed, failures are retried right away */
+        QUADRINO_GPS_BUS_BACKOFF,                       /* retries failed, the poll interval doubles every cycle */
+        QUADRINO_GPS_BUS_RESET,                         /* the module didn't answer after a bus reset */
+};
+
+struct quadrino_gps_bus {
+        enum quadrino_gps_bus_state state;
+        ktime_t since;                                  /* when the state was entered */
+        unsigned int errors;                            /* consecutive failed cycles */
+        unsigned int backoff;                           /* msecs until the next attempt while not ok */
+        unsigned int retries;                           /* immediate retries of a failed transfer */
+        unsigned int backoff_max;                       /* longest backoff in msecs */
+        u8 version;                                     /* I2C_GPS_REG_VERSION at the last probe, 0 if none */
+};
+
+struct quadrino_gps;
+
+void quadrino_gps_bus_init(struct quadrino_gps_bus *bus, unsigned int retries, unsigned int backoff_max);
+const char *quadrino_gps_bus_state_name(enum quadrino_gps_bus_state state);
+int quadrino_gps_bus_read(struct quadrino_gps *gps, unsigned int reg, void *buf, size_t count);
+void quadrino_gps_bus_ok(struct quadrino_gps *gps);
+void quadrino_gps_bus_failed(struct quadrino_gps *gps);
+unsigned long quadrino_gps_bus_delay(struct quadrino_gps *gps, unsigned long delay);
+
+/*
+ * Flight recorder, see gps-quadrino-recorder.c
+ */
+struct quadrino_gps_recorder {
+        struct quadrino_gps_recorder_record *records;   /* vmalloc'd, NULL while the recorder is off */
+        u32 capacity;                                   /* power of two */
+        unsigned long head;                             /* records written, published with a release store */
+};
+
+struct dentry;
+
+int quadrino_gps_recorder_init(struct quadrino_gps_recorder *rec, unsigned int capacity);
+void quadrino_gps_recorder_free(struct quadrino_gps_recorder *rec);
+void quadrino_gps_recorder_debugfs_add(struct quadrino_gps_recorder *rec, struct dentry *dir);
+void quadrino_gps_recorder_fix(struct quadrino_gps_recorder *rec, STATUS_REGISTER status,
+        const GPS_COORDINATES *location, const GPS_DETAIL *detail, ktime_t timestamp);
+void quadrino_gps_recorder_error(struct quadrino_gps_recorder *rec, u8 type, u8 reg, int error, ktime_t timestamp);
+
+/*
+ * GPS time source, see gps-quadrino-ptp.c
+ */
+struct quadrino_gps_ptp {
+        gpscore_timesync sync;                          /* offset filter, owned by the poll cycle */
+        seqlock_t lock;                                 /* publishes valid and offset to the clock */
+        bool valid;
+        s64 offset;                                     /* UTC minus CLOCK_MONOTONIC in nsecs */
+        struct ptp_clock *clock;                        /* NULL unless registered */
+        struct ptp_clock_info info;
+};
+
+void quadrino_gps_ptp_init(struct quadrino_gps_ptp *ptp, int leap_seconds);
+int quadrino_gps_ptp_register(struct quadrino_gps_ptp *ptp, struct device *parent, int index);
+void quadrino_gps_ptp_unregister(struct quadrino_gps_ptp *ptp);
+int quadrino_gps_ptp_index(struct quadrino_gps_ptp *ptp);
+void quadrino_gps_ptp_sample(struct quadrino_gps_ptp *ptp, STATUS_REGISTER status, const GPS_DETAIL *detail,
+        ktime_t start, ktime_t end);
+
+/*
+ * Poll cycle statistics, see gps-quadrino-debugfs.c
+ */
+#define QUADRINO_GPS_HIST_BUCKETS 32
+
+/* log2 histogram, bucket n counts values in [2^(n-1), 2^n) nsecs */
+struct quadrino_gps_hist {
+        u64 buckets[QUADRINO_GPS_HIST_BUCKETS];
+        u64 count;
+        u64 total;
+        u64 max;
+};
+
+struct quadrino_gps_stats {
+        struct quadrino_gps_hist status_latency;        /* status byte poll */
+        struct quadrino_gps_hist burst_latency;         /* status, location and detail burst */
+        struct quadrino_gps_hist jitter;                /* poll cycle lateness */
+        struct quadrino_gps_hist format_time;           /* NMEA formatting of one batch */
+        u64 cycles;
+        u64 updates;                                    /* module updates read */
+        u64 duplicates;                                 /* updates skipped because they repeated the last epoch */
+        u64 unread;                                     /* updates not formatted, no tty or stream reader */
+        u64 estimates;                                  /* dead reckoned epochs output */
+        u64 events;                                     /* status edges reported on the event device */
+        u64 retries;                                    /* immediate retries of failed transfers */
+        u64 retried_ok;                                 /* transfers that succeeded on a retry */
+        u64 backoffs;                                   /* failed cycles that slowed down polling */
+        u64 bus_resets;
+        u64 reprobes;                                   /* the module answered after a bus reset */
+        u64 reprobe_failures;
+        u64 tty_bytes;
+        u64 tty_dropped;                                /* bytes the tty flip buffer had no room for */
+        u64 stream_bytes;
+        u32 failures[I2C_GPS_MAX_REGISTER + 1];         /* failed transfers by start register */
+        struct dentry *dir;                             /* must stay last, reset clears everything before it */
+};
+
+static inline void quadrino_gps_hist_add(struct quadrino_gps_hist *hist, s64 ns)
+{
+        unsigned int bucket;
+
+        if (ns < 0)
+                ns = 0;
+        bucket = min_t(unsigned int, fls64(ns), QUADRINO_GPS_HIST_BUCKETS - 1);
+        hist->buckets[bucket]++;
+        hist->count++;
+        hist->total += ns;
+        if (ns > hist->max)
+                hist->max = ns;
+}
+
+void quadrino_gps_debugfs_init(void);
+void quadrino_gps_debugfs_exit(void);
+void quadrino_gps_debugfs_add(struct quadrino_gps *gps, const char *name);
+void quadrino_gps_debugfs_remove(struct quadrino_gps_stats *stats);
+
+/* the last real fix, the base of dead reckoned epochs */
+struct quadrino_gps_dr {
+        bool valid;
+        STATUS_REGISTER status;
+        GPS_COORDINATES location;
+        GPS_DETAIL detail;
+        ktime_t timestamp;                              /* when the fix was read */
+        ktime_t next;                                   /* when the next estimated epoch is due */
+};
+
+/* room for all sentences of one epoch */
+#define QUADRINO_GPS_OUTPUT_SIZE 512
+
+/* depth of the module command queue, see the command attribute */
+#define QUADRINO_GPS_COMMAND_QUEUE 16
+
+// detection of the board we are connected to
+typedef enum {
+    OTHER,
+    GPS_QUADRINO
+} GPSDeviceModel;
+
+/* DMA-safe buffer for the register burst read, must be kmalloc'd */
+struct quadrino_gps_shadow {
+        GPS_REGISTERS regs ____cacheline_aligned;      /* shadow image of registers 0..42 */
+};
+
+/* poll engine scheduling jitter in nsecs, see the poll_jitter attribute */
+struct quadrino_gps_jitter {
+        s64 last;
+        s64 min;
+        s64 max;
+        s64 total;
+        u64 samples;
+};
+
+/*
+ * Per-device state, one for every GPS module bound to the driver
+ */
+struct quadrino_gps {
+        struct tty_port port;                   /* must be first, the port's refcount owns this struct */
+        struct i2c_client *client;
+        struct regmap *regmap;                  /* volatile status/nav window, cached config and waypoints */
+        struct device *tty_dev;
+        GPSDeviceModel board;
+        int index;                              /* tty minor and device number */
+        bool is_open;                           /* the tty is open by at least one file */
+        int tty_format;                         /* QUADRINO_GPS_FORMAT_* of the tty output */
+        bool removing;                          /* set once remove started, stops the worker */
+        atomic_t consumers;                     /* tty, fix ring, stream, event, recorder and PTP users, the worker runs while non-zero */
+
+        struct delayed_work work;
+        struct mutex poll_lock;                 /* serializes poll cycles of the poll engine and irq thread */
+        struct quadrino_gps_shadow *shadow;
+        gpsclock clock;
+        gpscore_epoch last_epoch;
+        char output[QUADRINO_GPS_OUTPUT_SIZE];  /* sentences of the current epoch */
+        unsigned int sentences;                 /* NMEA_* mask of the sentences to output */
+
+        gpscore_sched sched;                    /* adaptive poll state, see quadrino_gps_next_poll() */
+        ktime_t bus_due;                        /* when the poll engine next reads the module */
+        struct quadrino_gps_bus bus;            /* error recovery, see quadrino_gps_bus_failed() */
+
+        /* dead reckoning between fixes, see quadrino_gps_dr_output() */
+        struct quadrino_gps_dr dr;
+        unsigned int dr_rate;                   /* estimated epochs per second, 0 disables */
+        unsigned int dr_horizon;                /* msecs after a fix estimates stop */
+
+        /* optional dedicated poll engine, see quadrino_gps_poll_thread_start() */
+        struct task_struct *poll_thread;
+        struct hrtimer poll_timer;
+        atomic_t poll_due;
+        ktime_t poll_deadline;                  /* when the next cycle is due, under poll_lock */
+        bool poll_stopped;                      /* the thread is stopping, the timer stays disarmed */
+        struct quadrino_gps_jitter jitter;
+        struct quadrino_gps_stats stats;
+
+        /* module commands queued from sysfs, see quadrino_gps_command_worker() */
+        struct work_struct command_work;
+        spinlock_t command_lock;
+        DECLARE_KFIFO(command_fifo, u8, QUADRINO_GPS_COMMAND_QUEUE);
+
+        /* optional data-ready interrupt, see quadrino_gps_irq_init() */
+        int irq;
+        unsigned long irq_count;
+
+        /* latest decoded fix, written by the poll cycle, see quadrino_gps_get_fix() */
+        seqlock_t fix_lock;
+        struct quadrino_gps_fix fix;
+
+        struct quadrino_gps_fixring fixring;
+        struct quadrino_gps_stream stream;
+        struct quadrino_gps_events events;
+        struct quadrino_gps_recorder recorder;
+        struct quadrino_gps_ptp ptp;
+};
+
+#endif // __QUADRINO_GPS_H
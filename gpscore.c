@@ -0,0 +1,158 @@
+
+#include "gpscore.h"
+
+#if !defined(__KERNEL__)
+#include <string.h>
+#include <errno.h>
+#define gpscore_div64(n, d)     ((n) / (d))
+#else
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#define gpscore_div64(n, d)     div_s64(n, d)
+#endif
+
+#define GPSCORE_NSEC_PER_MSEC   1000000
+#define GPSCORE_USEC_PER_MSEC   1000
+#define GPSCORE_NSEC_PER_SEC    1000000000LL
+#define GPSCORE_NSEC_PER_TICK   10000000        // module time of week is in 1/100 secs
+
+void gpscore_sched_init(gpscore_sched* sched, uint32_t poll_interval)
+{
+    sched->poll_interval = poll_interval;
+    sched->update_period = 0;
+    sched->last_update = 0;
+}
+
+void gpscore_sched_learn(gpscore_sched* sched, int64_t now)
+{
+    int64_t delta;
+
+    if(sched->last_update) {
+        delta = gpscore_div64(now - sched->last_update, GPSCORE_NSEC_PER_MSEC);
+        if(delta < GPSCORE_UPDATE_PERIOD_MIN || delta > GPSCORE_UPDATE_PERIOD_MAX)
+            sched->update_period = 0;       // discontinuity, relearn
+        else if(!sched->update_period)
+            sched->update_period = (uint32_t)delta;
+        else
+            sched->update_period = (sched->update_period*7 + (uint32_t)delta) / 8;
+    }
+    sched->last_update = now;
+}
+
+uint32_t gpscore_sched_next(const gpscore_sched* sched, int64_t now)
+{
+    uint32_t interval = sched->poll_interval;
+    uint32_t elapsed, guard;
+
+    if(!interval)
+        return GPSCORE_READ_TIME * GPSCORE_USEC_PER_MSEC;
+
+    if(sched->update_period && sched->last_update) {
+        elapsed = (uint32_t)gpscore_div64(now - sched->last_update, GPSCORE_NSEC_PER_MSEC);
+        guard = sched->update_period / 8;
+        if(guard < interval)
+            guard = interval;
+        if(elapsed + guard < sched->update_period)
+            return (sched->update_period - guard - elapsed) * GPSCORE_USEC_PER_MSEC;
+    }
+    return interval * GPSCORE_USEC_PER_MSEC;
+}
+
+int gpscore_epoch_new(gpscore_epoch* last, STATUS_REGISTER status, const GPS_DETAIL* detail)
+{
+    uint8_t flags = *(uint8_t*)&status & ~I2C_GPS_STATUS_NEW_DATA;
+
+    if(last->valid && last->status == flags && last->week == detail->week && last->time == detail->time)
+        return 0;
+
+    last->valid = 1;
+    last->status = flags;
+    last->week = detail->week;
+    last->time = detail->time;
+    return 1;
+}
+
+void gpscore_decode(const GPS_REGISTERS* regs, nmea_epoch* epoch)
+{
+    epoch->status = gps_registers_status(regs);
+    epoch->estimated = 0;
+    gps_registers_detail(regs, &epoch->detail);
+    if(epoch->status.gps2dfix || epoch->status.gps3dfix) {
+        gps_registers_location(regs, &epoch->location);
+    } else {
+        // no fix, the module may still know the time
+        memset(&epoch->location, 0, sizeof(epoch->location));
+        epoch->detail.ground_speed = 0;
+        epoch->detail.altitude = 0;
+        epoch->detail.ground_course = 0;
+    }
+}
+
+unsigned int gpscore_sentences(unsigned int mask, const nmea_epoch* epoch)
+{
+    // losing the fix is reported in the sentences themselves, only a module that doesn't know the time yet has
+    // nothing to report but GSA
+    if(!epoch->status.gps2dfix && !epoch->status.gps3dfix && !epoch->detail.week)
+        mask &= ~(NMEA_FIX_DATA|NMEA_ZDA);
+    return mask;
+}
+
+int gpscore_format(char* out, int out_length, unsigned int mask, gpsclock* clock, nmea_epoch* epoch)
+{
+    mask = gpscore_sentences(mask, epoch);
+    if(!mask)
+        return 0;
+
+    gps_clock_convert(clock, &epoch->detail, &epoch->broken);
+    return nmea_sentences(out, out_length, mask, epoch);
+}
+
+int64_t gpscore_utc_ns(const GPS_DETAIL* detail, int leap_seconds)
+{
+    int64_t seconds = GPSCORE_GPS_EPOCH + (int64_t)detail->week*(7*86400) + detail->time/100 - leap_seconds;
+
+    return seconds*GPSCORE_NSEC_PER_SEC + (int64_t)(detail->time % 100)*GPSCORE_NSEC_PER_TICK;
+}
+
+void gpscore_timesync_init(gpscore_timesync* sync, int leap_seconds)
+{
+    memset(sync, 0, sizeof(*sync));
+    sync->leap_seconds = leap_seconds;
+}
+
+int gpscore_timesync_sample(gpscore_timesync* sync, STATUS_REGISTER status, const GPS_DETAIL* detail, int64_t now)
+{
+    int64_t sample, delta;
+
+    if(!detail->week || (!status.gps2dfix && !status.gps3dfix))
+        return -1;
+
+    sample = gpscore_utc_ns(detail, sync->leap_seconds) - now;
+    sync->samples++;
+    sync->last = now;
+
+    // the first sample gives a rough estimate right away, the windows refine it
+    if(!sync->valid) {
+        sync->valid = 1;
+        sync->offset = sample;
+        sync->count = 0;
+        return 1;
+    }
+
+    if(!sync->count || sample > sync->window)
+        sync->window = sample;
+    if(++sync->count < GPSCORE_TIMESYNC_WINDOW)
+        return 0;
+    sync->count = 0;
+
+    // a module restart or a leap second moves the time too far to slew
+    delta = sync->window - sync->offset;
+    if(delta > GPSCORE_TIMESYNC_STEP || delta < -GPSCORE_TIMESYNC_STEP) {
+        sync->offset = sync->window;
+        sync->steps++;
+    } else
+        sync->offset += gpscore_div64(delta, 4);
+    return 1;
+}
@@ -0,0 +1,102 @@
+#ifndef __QUADRINO_GPS_CORE_H
+#define __QUADRINO_GPS_CORE_H
+
+#include "registers.h"
+#include "nmea.h"
+
+/*
+ * Shared read pipeline
+ *
+ * The parts of the driver that don't depend on how the registers are reached: when to poll, which reads hold a new
+ * module update, decoding the register window and which sentences an update gets. The kernel driver and the
+ * userspace i2c-dev daemon both run this code so both deployments behave and perform the same. Times are
+ * CLOCK_MONOTONIC nanoseconds.
+ */
+
+/// Full register read period in msecs when adaptive polling is off, the modules default update rate
+#define GPSCORE_READ_TIME           1000
+
+/// Adaptive polling limits in msecs, the learned update period must fall within these bounds to be trusted
+#define GPSCORE_POLL_INTERVAL_MAX   GPSCORE_READ_TIME
+#define GPSCORE_UPDATE_PERIOD_MIN   20
+#define GPSCORE_UPDATE_PERIOD_MAX   (4*GPSCORE_READ_TIME)
+
+/// \brief Adaptive poll scheduler state.
+typedef struct _gpscore_sched {
+    uint32_t poll_interval;         // status poll interval in msecs, 0 reads everything every GPSCORE_READ_TIME
+    uint32_t update_period;         // learned module update period in msecs, 0 if unknown
+    int64_t  last_update;           // when new_data was last seen, 0 if never
+} gpscore_sched;
+
+/// \brief Identifies the last module update that was published.
+typedef struct _gpscore_epoch {
+    int valid;
+    uint8_t status;                 // status register without new_data
+    uint16_t week;
+    uint32_t time;
+} gpscore_epoch;
+
+/// Seconds between the Unix epoch and the GPS epoch (Jan 6, 1980)
+#define GPSCORE_GPS_EPOCH           (3657*86400)
+
+/// Time transfer filter, samples per window and the offset change in nsecs that steps instead of slews
+#define GPSCORE_TIMESYNC_WINDOW     8
+#define GPSCORE_TIMESYNC_STEP       100000000
+
+/// \brief Module time to CLOCK_MONOTONIC offset estimator.
+/// Every module update pairs the GPS time of the fix with the monotonic time of the transfer that read it. The read
+/// always comes some time after the fix so each sample is late by the read latency, the window keeps the least late
+/// sample and the offset follows the windows with a 1/4 weight moving average.
+typedef struct _gpscore_timesync {
+    int valid;                      // non-zero once offset holds an estimate
+    int leap_seconds;               // GPS-UTC offset in seconds, see gps_clock_init()
+    int64_t offset;                 // UTC minus CLOCK_MONOTONIC in nsecs
+    int64_t window;                 // largest offset sample of the current window
+    uint32_t count;                 // samples in the current window
+    uint32_t samples;               // samples taken since init
+    uint32_t steps;                 // windows that stepped the offset
+    int64_t last;                   // CLOCK_MONOTONIC time of the last sample, 0 if none
+} gpscore_timesync;
+
+/// \brief Converts the module week and time of week to UTC nsecs since the Unix epoch.
+int64_t gpscore_utc_ns(const GPS_DETAIL* detail, int leap_seconds);
+
+/// \brief Initializes (or resets) the offset estimator.
+void gpscore_timesync_init(gpscore_timesync* sync, int leap_seconds);
+
+/// \brief Adds the time of a new module update read at now.
+/// Only updates with a fix are used, a module without one may report a free running clock.
+/// \returns 1 if the offset was updated, 0 if the sample was only added to the window, -1 if it was ignored
+int gpscore_timesync_sample(gpscore_timesync* sync, STATUS_REGISTER status, const GPS_DETAIL* detail, int64_t now);
+
+/// \brief Sets the poll interval and forgets the learned update period.
+void gpscore_sched_init(gpscore_sched* sched, uint32_t poll_interval);
+
+/// \brief Learns the module update cadence from the time between new_data flags.
+/// The measurement is quantized by the poll interval so it is smoothed with a 1/8 weight moving average.
+void gpscore_sched_learn(gpscore_sched* sched, int64_t now);
+
+/// \brief Computes the delay in usecs until the next status poll.
+/// Right after an update we sleep until shortly before the next expected update, then poll at the configured
+/// interval until new_data is raised again.
+uint32_t gpscore_sched_next(const gpscore_sched* sched, int64_t now);
+
+/// \brief Returns non-zero if the registers hold a different module update than the last one published.
+/// An update is identified by its GPS time and status.
+int gpscore_epoch_new(gpscore_epoch* last, STATUS_REGISTER status, const GPS_DETAIL* detail);
+
+/// \brief Decodes the register window into an epoch, without a fix the location and motion are zeroed.
+/// The broken down time is left for gps_clock_convert() since not every consumer needs it.
+void gpscore_decode(const GPS_REGISTERS* regs, nmea_epoch* epoch);
+
+/// \brief Narrows a NMEA_* sentence mask to the sentences the epoch has data for.
+/// Without a fix GGA, RMC and VTG still go out with empty fields flagged as invalid so consumers see the fix was lost.
+/// Until the module knows the time only GSA goes out, it reports the fix state so it always does.
+unsigned int gpscore_sentences(unsigned int mask, const nmea_epoch* epoch);
+
+/// \brief Formats the sentences of an epoch into one batch, converting the time once.
+/// \returns the batch length, 0 if the epoch has no sentences, or -ENOSPC
+int gpscore_format(char* out, int out_length, unsigned int mask, gpsclock* clock, nmea_epoch* epoch);
+
+
+#endif // __QUADRINO_GPS_CORE_H
@@ -6,25 +6,180 @@
 #include <stdio.h>
 #include <time.h>
 #include <memory.h>
+#include <errno.h>
 #else
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/errno.h>
 #endif
 
 void time_to_tm(time_t totalsecs, int offset, struct tm *result);
 
 
+static const char nmea_hex[] = "0123456789abcdef";
+
+// two ascii digits for every value 0..99, lets us convert two digits per division
+static const char nmea_digits2[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/*
+ * Sentence writer
+ *
+ * Sentences are written straight into the caller's buffer while the checksum is accumulated, so there is no second
+ * pass over the sentence and no sprintf. The writer never writes past the end of the buffer, instead it records the
+ * overflow and the sentence is rejected when it is finished.
+ */
+typedef struct _nmea_writer {
+    char* begin;
+    char* p;
+    char* end;              // last usable byte, one byte is always held back for the nul terminator
+    uint8_t checksum;
+    uint8_t overflow;
+} nmea_writer;
+
+static inline void nmea_putc(nmea_writer* w, char c)
+{
+    if(w->p < w->end) {
+        *w->p++ = c;
+        w->checksum ^= (uint8_t)c;
+    } else
+        w->overflow = 1;
+}
+
+static inline void nmea_puts(nmea_writer* w, const char* s)
+{
+    while(*s)
+        nmea_putc(w, *s++);
+}
+
+/// writes an unsigned integer in decimal, zero padded to at least width digits
+static void nmea_put_uint(nmea_writer* w, uint32_t value, int width)
+{
+    char digits[10];
+    int n = 0;
+    uint32_t q;
+
+    while(value >= 100) {
+        q = value / 100;
+        value = (value - q*100) * 2;
+        digits[n++] = nmea_digits2[value+1];
+        digits[n++] = nmea_digits2[value];
+        value = q;
+    }
+    if(value >= 10) {
+        digits[n++] = nmea_digits2[value*2+1];
+        digits[n++] = nmea_digits2[value*2];
+    } else
+        digits[n++] = (char)('0' + value);
+
+    for(; width > n; width--)
+        nmea_putc(w, '0');
+    while(n > 0)
+        nmea_putc(w, digits[--n]);
+}
+
+/// starts a sentence, the '$' is not part of the checksum
+static void nmea_begin(nmea_writer* w, char* sout, int sout_length, const char* type)
+{
+    w->begin = w->p = sout;
+    w->end = sout + sout_length - 1;
+    w->checksum = 0;
+    w->overflow = (sout_length < 1);
+    if(w->p < w->end)
+        *w->p++ = '$';
+    else
+        w->overflow = 1;
+    nmea_puts(w, type);
+}
+
+/// appends the checksum and terminates the sentence
+/// \returns the length of the sentence not including the nul terminator, or -ENOSPC if the buffer was too small
+static int nmea_end(nmea_writer* w, int add_lf)
+{
+    uint8_t checksum = w->checksum;
+    nmea_putc(w, '*');
+    nmea_putc(w, nmea_hex[checksum >> 4]);
+    nmea_putc(w, nmea_hex[checksum & 0x0f]);
+    if(add_lf)
+        nmea_putc(w, '\n');
+    if(w->overflow) {
+        if(w->end >= w->begin)
+            *w->begin = 0;
+        return -ENOSPC;
+    }
+    *w->p = 0;
+    return (int)(w->p - w->begin);
+}
+
+/// writes lat,N,lon,E in DDMM.mmmmmm,DDDMM.mmmmmm format
+static void nmea_put_latlon(nmea_writer* w, const GPS_COORDINATES* location)
+{
+    geodms dms_lat, dms_lon;
+
+    degrees2dms(location->lat, &dms_lat);
+    degrees2dms(location->lon, &dms_lon);
+
+    nmea_put_uint(w, abs(dms_lat.degrees), 2); // lat
+    nmea_put_uint(w, dms_lat.minutes, 2);
+    nmea_putc(w, '.');
+    nmea_put_uint(w, dms_lat.fraction, 6);
+    nmea_putc(w, ',');
+    nmea_putc(w, (location->lat<0) ? 'S':'N');
+    nmea_putc(w, ',');
+    nmea_put_uint(w, abs(dms_lon.degrees), 3); // lon
+    nmea_put_uint(w, dms_lon.minutes, 2);
+    nmea_putc(w, '.');
+    nmea_put_uint(w, dms_lon.fraction, 6);
+    nmea_putc(w, ',');
+    nmea_putc(w, (location->lon<0) ? 'W':'E');
+}
+
+/// writes a value given in tenths with one decimal, ex. 1234 as 123.4
+static void nmea_put_tenths(nmea_writer* w, uint32_t tenths)
+{
+    uint32_t whole = tenths / 10;
+    nmea_put_uint(w, whole, 1);
+    nmea_putc(w, '.');
+    nmea_put_uint(w, tenths - whole*10, 1);
+}
+
+/// ground speed in cm/s to tenths of a knot (1 knot = 1852/3600 m/s), rounded
+static inline uint32_t nmea_knots10(uint16_t ground_speed)
+{
+    return ((uint32_t)ground_speed*360 + 926) / 1852;
+}
+
+/// ground speed in cm/s to tenths of a km/h, rounded
+static inline uint32_t nmea_kmh10(uint16_t ground_speed)
+{
+    return ((uint32_t)ground_speed*36 + 50) / 100;
+}
+
+
 int nmea_checksum(char* nmea_sentence, int* output_length, int add_lf)
 {
     // see this page for reference on computing nmea checksums
     // https://rietman.wordpress.com/2008/09/25/how-to-calculate-the-nmea-checksum/
     char* p = nmea_sentence;
-    int checksum=0;
+    uint8_t checksum=0;
     if(*p=='$') p++;
     while(*p)
-        checksum ^= *p++;
+        checksum ^= (uint8_t)*p++;
     *p++ = '*';
-    p += sprintf(p, add_lf ? "%02x\n" : "%02x", checksum);
+    *p++ = nmea_hex[checksum >> 4];
+    *p++ = nmea_hex[checksum & 0x0f];
+    if(add_lf)
+        *p++ = '\n';
+    *p = 0;
     if(output_length !=NULL)
         *output_length = p-nmea_sentence;
     return checksum;
@@ -83,17 +238,70 @@ int gps_time2tm(GPS_DETAIL* detail, struct tm* broken)
     return 0;
 }
 
-int nmea_zda(char* sout, int sout_length, GPS_DETAIL* detail)
+void gps_clock_init(gpsclock* clock, int leap_seconds)
 {
-    struct tm broken;
-    int len;
+    memset(clock, 0, sizeof(*clock));
+    clock->leap_seconds = leap_seconds;
+}
 
-    if((len=gps_time2tm(detail, &broken))!=0)
-        return len;
+int gps_clock_convert(gpsclock* clock, const GPS_DETAIL* detail, struct tm* broken)
+{
+    int32_t week = detail->week;
+    int32_t seconds = (int32_t)(detail->time / 100) - clock->leap_seconds;
+    int32_t delta, tod;
+    time_t datetime;
+
+    // the leap second offset can move us into the previous (or next) week
+    while(seconds < 0) {
+        seconds += 7*86400;
+        week--;
+    }
+    while(seconds >= 7*86400) {
+        seconds -= 7*86400;
+        week++;
+    }
 
-    // broken components are somewhat relative to constants, lets adjust it
-    broken.tm_mon++;
-    broken.tm_year += 1900;
+    if(clock->valid && week == clock->week && seconds >= clock->seconds) {
+        delta = seconds - clock->seconds;
+        tod = seconds - clock->day_start;
+        if(delta < 60) {
+            // typical case, carry the few seconds since the last fix into minutes and hours
+            clock->broken.tm_sec += delta;
+            if(clock->broken.tm_sec >= 60) {
+                clock->broken.tm_sec -= 60;
+                if(++clock->broken.tm_min >= 60) {
+                    clock->broken.tm_min = 0;
+                    clock->broken.tm_hour++;
+                }
+            }
+            if(clock->broken.tm_hour < 24)
+                goto done;
+        } else if(tod < 86400) {
+            // same day but a longer gap, rebuild the time of day only
+            clock->broken.tm_hour = tod / 3600;
+            tod -= clock->broken.tm_hour * 3600;
+            clock->broken.tm_min = tod / 60;
+            clock->broken.tm_sec = tod - clock->broken.tm_min * 60;
+            goto done;
+        }
+    }
+
+    // first conversion, day rollover or discontinuity so do the full calendar conversion
+    datetime = (time_t)(3657 + week*7)*86400 + seconds;     // 3657 days between the linux and gps epochs
+    time_to_tm(datetime, 0, &clock->broken);
+    clock->day_start = seconds - (clock->broken.tm_hour*3600 + clock->broken.tm_min*60 + clock->broken.tm_sec);
+    clock->week = (uint16_t)week;
+    clock->valid = 1;
+
+done:
+    clock->seconds = seconds;
+    *broken = clock->broken;
+    return 0;
+}
+
+int nmea_zda_tm(char* sout, int sout_length, const GPS_DETAIL* detail, const struct tm* broken)
+{
+    nmea_writer w;
 
     /*
      * GPZDA  Date & Time
@@ -108,46 +316,41 @@ int nmea_zda(char* sout, int sout_length, GPS_DETAIL* detail)
      *   xx = Local zone description, 00 to +/- 13 hours
      *   xx = Local zone minutes description (keep same sign as hours)
      */
-    len = sprintf(sout, "$GPZDA,"
-            "%02d%02d%02d.%d,"        // time
-            "%d,%d,%4d,"      // day, month, year
-            "00,00",               // TZ hours,minutes
-            broken.tm_hour, broken.tm_min, broken.tm_sec,
-            detail->time %100,  // milliseconds
-            broken.tm_mday, broken.tm_mon, (int)broken.tm_year
-    );
+    nmea_begin(&w, sout, sout_length, "GPZDA,");
+    nmea_put_uint(&w, broken->tm_hour, 2);       // time
+    nmea_put_uint(&w, broken->tm_min, 2);
+    nmea_put_uint(&w, broken->tm_sec, 2);
+    nmea_putc(&w, '.');
+    nmea_put_uint(&w, detail->time % 100, 1);   // hundredths of a second
+    nmea_putc(&w, ',');
+    nmea_put_uint(&w, broken->tm_mday, 1);       // day, month, year
+    nmea_putc(&w, ',');
+    nmea_put_uint(&w, broken->tm_mon + 1, 1);
+    nmea_putc(&w, ',');
+    nmea_put_uint(&w, broken->tm_year + 1900, 4);
+    nmea_puts(&w, ",00,00");                    // TZ hours,minutes
 
     // add checksum
-    len = sizeof(sout);
-    nmea_checksum(sout, &len, 1);
-
-    return len;
-
+    return nmea_end(&w, 1);
 }
 
-int nmea_gga(char* sout, int sout_length, STATUS_REGISTER* status, GPS_COORDINATES* location, GPS_DETAIL* detail)
+int nmea_zda(char* sout, int sout_length, GPS_DETAIL* detail)
 {
     struct tm broken;
     int len;
-    geodms dms_lat, dms_lon;
 
-#if 1
-    // will need to parse datetime components for NMEA display
     if((len=gps_time2tm(detail, &broken))!=0)
         return len;
-#else
-    uint32_t tod, time;
-
-    time = detail->time%8640000;
-    broken.tm_hour = time / 360000;
-    tod = time - hour*360000;
-    broken.tm_min = (tod / 6000);
-    tod -= min*6000;
-    broken.tm_sec = (tod / 100);
-#endif
+    return nmea_zda_tm(sout, sout_length, detail, &broken);
+}
 
-    degrees2dms(location->lat, &dms_lat);
-    degrees2dms(location->lon, &dms_lon);
+/// GGA with fix quality 6 when the position was estimated by dead reckoning
+static int nmea_gga_estimated(char* sout, int sout_length, const STATUS_REGISTER* status,
+                              const GPS_COORDINATES* location, const GPS_DETAIL* detail, const struct tm* broken,
+                              int estimated)
+{
+    nmea_writer w;
+    int fix = estimated || status->gps2dfix || status->gps3dfix;
 
 /* $GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47
 
@@ -173,39 +376,232 @@ int nmea_gga(char* sout, int sout_length, STATUS_REGISTER* status, GPS_COORDINAT
          (empty field) time in seconds since last DGPS update
          (empty field) DGPS station ID number
          *47          the checksum data, always begins with *
-*/
-    //printf("https://www.google.com/maps/@%9.7f,%9.7f,21z\n", location->lat/10000000.0, location->lon/10000000.0);
-    //printf("LAT: %9.7f => %d:%d:%d\n", location->lat/10000000.0, lat_deg, lat_min, lat_dec);
-    //printf("LON: %9.7f => %d:%d:%d\n", location->lon/10000000.0, lon_deg, lon_min, lon_dec);
 
+    Without a fix the position, hdop and altitude fields are empty and the fix quality is 0.
+*/
     // output the GPS location
     // GPGGA,time,lat,N,lon,E,fix,sats,hdop,alt,M,height_geod,M,,*chksum
-//   printf("# %4.6f, %4.6f\n", (double)location->lat/10000000.0, (double)location->lon/10000000.0);
-    len = sprintf(sout, "$GPGGA,"
-                          "%02d%02d%02d,"        // time
-                          "%02d%02d.%06d,%c,"      // lat
-                          "%03d%02d.%06d,%c,"      // lon
-                          "%d,%d,"               // fix + sats
-                          "0.9,"               // hdop
-                          "%d.0,M,"             // altitude + unit
-                          "0.0,M,"             // height of geoid + unit
-                          ",,",               // 2x empty fields plus checksum
-                  broken.tm_hour, broken.tm_min, broken.tm_sec,
-                  (int)abs(dms_lat.degrees), dms_lat.minutes, dms_lat.fraction, (location->lat<0) ? 'S':'N',
-                  (int)abs(dms_lon.degrees), dms_lon.minutes, dms_lon.fraction, (location->lon<0) ? 'W':'E',
-                  status->gps3dfix
-                  ? 2
-                  : status->gps2dfix
-                    ? 1
-                    : 0,
-                  status->numsats,
-                  detail->altitude
-    );
+    nmea_begin(&w, sout, sout_length, "GPGGA,");
+    nmea_put_uint(&w, broken->tm_hour, 2);       // time
+    nmea_put_uint(&w, broken->tm_min, 2);
+    nmea_put_uint(&w, broken->tm_sec, 2);
+    nmea_putc(&w, ',');
+    if(fix)
+        nmea_put_latlon(&w, location);
+    else
+        nmea_puts(&w, ",,,");
+    nmea_putc(&w, ',');
+    nmea_put_uint(&w, estimated                 // fix + sats
+                      ? 6
+                      : status->gps3dfix
+                        ? 2
+                        : status->gps2dfix
+                          ? 1
+                          : 0, 1);
+    nmea_putc(&w, ',');
+    nmea_put_uint(&w, status->numsats, 1);
+    if(fix) {
+        nmea_puts(&w, ",0.9,");                 // hdop
+        nmea_put_uint(&w, detail->altitude, 1); // altitude + unit
+        nmea_puts(&w, ".0,M,"
+                      "0.0,M,"                  // height of geoid + unit
+                      ",,");                    // 2x empty fields plus checksum
+    } else
+        nmea_puts(&w, ",,,M,,M,,,");
 
     // add checksum
-    len = sizeof(sout);
-    nmea_checksum(sout, &len, 1);
+    return nmea_end(&w, 1);
+}
+
+int nmea_gga_tm(char* sout, int sout_length, const STATUS_REGISTER* status, const GPS_COORDINATES* location,
+                const GPS_DETAIL* detail, const struct tm* broken)
+{
+    return nmea_gga_estimated(sout, sout_length, status, location, detail, broken, 0);
+}
+
+int nmea_gga(char* sout, int sout_length, STATUS_REGISTER* status, GPS_COORDINATES* location, GPS_DETAIL* detail)
+{
+    struct tm broken;
+    int len;
 
-    return len;
+    // will need to parse datetime components for NMEA display
+    if((len=gps_time2tm(detail, &broken))!=0)
+        return len;
+    return nmea_gga_tm(sout, sout_length, status, location, detail, &broken);
+}
+
+/// NMEA 2.3 mode indicator of RMC and VTG
+static char nmea_mode(const STATUS_REGISTER* status, int estimated)
+{
+    if(estimated)
+        return 'E';
+    return (status->gps2dfix || status->gps3dfix) ? 'A' : 'N';
+}
+
+static int nmea_rmc_estimated(char* sout, int sout_length, const STATUS_REGISTER* status,
+                              const GPS_COORDINATES* location, const GPS_DETAIL* detail, const struct tm* broken,
+                              int estimated)
+{
+    nmea_writer w;
+    int fix = status->gps2dfix || status->gps3dfix;
+
+/* $GPRMC,123519.00,A,4807.038,N,01131.000,E,022.4,084.4,230394,,,A*6A
+
+    Where:
+         RMC          Recommended Minimum sentence C
+         123519.00    Fix taken at 12:35:19 UTC
+         A            Status A=active or V=Void
+         4807.038,N   Latitude 48 deg 07.038' N
+         01131.000,E  Longitude 11 deg 31.000' E
+         022.4        Speed over the ground in knots
+         084.4        Track angle in degrees True
+         230394       Date - 23rd of March 1994
+         ,            Magnetic Variation, not known
+         A            Mode indicator: A=autonomous, E=estimated, N=not valid (2.3 feature)
+*/
+    nmea_begin(&w, sout, sout_length, "GPRMC,");
+    nmea_put_uint(&w, broken->tm_hour, 2);       // time
+    nmea_put_uint(&w, broken->tm_min, 2);
+    nmea_put_uint(&w, broken->tm_sec, 2);
+    nmea_putc(&w, '.');
+    nmea_put_uint(&w, detail->time % 100, 2);   // hundredths of a second
+    nmea_putc(&w, ',');
+    nmea_putc(&w, fix ? 'A' : 'V');
+    nmea_putc(&w, ',');
+    if(fix) {
+        nmea_put_latlon(&w, location);
+        nmea_putc(&w, ',');
+        nmea_put_tenths(&w, nmea_knots10(detail->ground_speed));
+        nmea_putc(&w, ',');
+        nmea_put_tenths(&w, detail->ground_course);
+        nmea_putc(&w, ',');
+    } else
+        nmea_puts(&w, ",,,,,,");                // position, speed and course not known
+    nmea_put_uint(&w, broken->tm_mday, 2);       // date ddmmyy
+    nmea_put_uint(&w, broken->tm_mon + 1, 2);
+    nmea_put_uint(&w, broken->tm_year % 100, 2);
+    nmea_puts(&w, ",,,");                       // magnetic variation and its direction
+    nmea_putc(&w, nmea_mode(status, estimated));
+
+    // add checksum
+    return nmea_end(&w, 1);
 }
 
+int nmea_rmc_tm(char* sout, int sout_length, const STATUS_REGISTER* status, const GPS_COORDINATES* location,
+                const GPS_DETAIL* detail, const struct tm* broken)
+{
+    return nmea_rmc_estimated(sout, sout_length, status, location, detail, broken, 0);
+}
+
+static int nmea_vtg_estimated(char* sout, int sout_length, const STATUS_REGISTER* status, const GPS_DETAIL* detail,
+                              int estimated)
+{
+    nmea_writer w;
+
+/* $GPVTG,054.7,T,,M,005.5,N,010.2,K,A*48
+
+    Where:
+         VTG          Track made good and ground speed
+         054.7,T      True track made good (degrees)
+         ,M           Magnetic track made good, not known
+         005.5,N      Ground speed, knots
+         010.2,K      Ground speed, Kilometers per hour
+         A            Mode indicator: A=autonomous, E=estimated, N=not valid (2.3 feature)
+
+    Without a fix the course and speed fields are empty.
+*/
+    nmea_begin(&w, sout, sout_length, "GPVTG,");
+    if(estimated || status->gps2dfix || status->gps3dfix) {
+        nmea_put_tenths(&w, detail->ground_course);
+        nmea_puts(&w, ",T,,M,");
+        nmea_put_tenths(&w, nmea_knots10(detail->ground_speed));
+        nmea_puts(&w, ",N,");
+        nmea_put_tenths(&w, nmea_kmh10(detail->ground_speed));
+        nmea_puts(&w, ",K,");
+    } else
+        nmea_puts(&w, ",T,,M,,N,,K,");
+    nmea_putc(&w, nmea_mode(status, estimated));
+
+    // add checksum
+    return nmea_end(&w, 1);
+}
+
+int nmea_vtg(char* sout, int sout_length, const STATUS_REGISTER* status, const GPS_DETAIL* detail)
+{
+    return nmea_vtg_estimated(sout, sout_length, status, detail, 0);
+}
+
+int nmea_gsa(char* sout, int sout_length, const STATUS_REGISTER* status)
+{
+    nmea_writer w;
+
+/* $GPGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1*39
+
+    Where:
+         GSA      Satellite status
+         A        Auto selection of 2D or 3D fix (M = manual)
+         3        3D fix - values include: 1 = no fix
+                                           2 = 2D fix
+                                           3 = 3D fix
+         04,05... PRNs of satellites used for fix (space for 12)
+         2.5      PDOP (dilution of precision)
+         1.3      Horizontal dilution of precision (HDOP)
+         2.1      Vertical dilution of precision (VDOP)
+
+    The module reports neither the satellite PRNs nor the dilution of precision so those fields are left empty.
+*/
+    nmea_begin(&w, sout, sout_length, "GPGSA,A,");
+    nmea_put_uint(&w, status->gps3dfix
+                      ? 3
+                      : status->gps2dfix
+                        ? 2
+                        : 1, 1);
+    nmea_puts(&w, ",,,,,,,,,,,,,,,");           // 12 PRNs, PDOP, HDOP and VDOP
+
+    // add checksum
+    return nmea_end(&w, 1);
+}
+
+int nmea_sentences(char* sout, int sout_length, unsigned int mask, const nmea_epoch* epoch)
+{
+    int len, total = 0;
+
+    if(sout_length < 1)
+        return -ENOSPC;
+    *sout = 0;
+
+    if(mask & NMEA_ZDA) {
+        len = nmea_zda_tm(sout + total, sout_length - total, &epoch->detail, &epoch->broken);
+        if(len < 0)
+            return len;
+        total += len;
+    }
+    if(mask & NMEA_GGA) {
+        len = nmea_gga_estimated(sout + total, sout_length - total, &epoch->status, &epoch->location,
+                                 &epoch->detail, &epoch->broken, epoch->estimated);
+        if(len < 0)
+            return len;
+        total += len;
+    }
+    if(mask & NMEA_RMC) {
+        len = nmea_rmc_estimated(sout + total, sout_length - total, &epoch->status, &epoch->location,
+                                 &epoch->detail, &epoch->broken, epoch->estimated);
+        if(len < 0)
+            return len;
+        total += len;
+    }
+    if(mask & NMEA_VTG) {
+        len = nmea_vtg_estimated(sout + total, sout_length - total, &epoch->status, &epoch->detail,
+                                 epoch->estimated);
+        if(len < 0)
+            return len;
+        total += len;
+    }
+    if(mask & NMEA_GSA) {
+        len = nmea_gsa(sout + total, sout_length - total, &epoch->status);
+        if(len < 0)
+            return len;
+        total += len;
+    }
+    return total;
+}
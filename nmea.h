@@ -3,6 +3,11 @@
 
 #include "registers.h"
 
+#if !defined(__KERNEL__)
+#include <time.h>
+#else
+#include <linux/time.h>
+#endif
 
 typedef struct _geodms {
     int16_t degrees;
@@ -29,19 +34,102 @@ int nmea_checksum(char* nmea_sentence, int* output_length, int add_lf);
 /// \param geo Holds the resulting components when degrees is converted to integer degrees, minutes and fractional minutes (DD MM.mmmmm)
 void degrees2dms(int degrees, geodms* geo);
 
+/// \brief Converts the GPS week number and time of week into broken out UTC date/time components.
+/// \param detail The speed, altitude, course and date/time registers from the GPS sensor data
+/// \param broken Receives the date/time components, see time_to_tm()
+/// \returns zero on success
+int gps_time2tm(GPS_DETAIL* detail, struct tm* broken);
+
+/// \brief Incremental GPS time to UTC converter.
+/// Converting the week and time of week from scratch requires the full calendar calculation for every sentence. This
+/// converter caches the date of the current day and only advances the time of day from the previous fix, the full
+/// conversion is done only on day rollover or when time jumps backwards or across days.
+typedef struct _gpsclock {
+    int leap_seconds;       // GPS-UTC offset in seconds, subtracted from the module time
+    int valid;              // non-zero once the cached date is valid
+    uint16_t week;          // GPS week of the cached date (after the leap second offset is applied)
+    int32_t seconds;        // seconds into the week of the previous conversion
+    int32_t day_start;      // seconds into the week at midnight of the cached date
+    struct tm broken;       // date/time of the previous conversion
+} gpsclock;
+
+/// \brief Initializes (or resets) a GPS clock converter.
+/// \param leap_seconds GPS-UTC offset in seconds. Use 0 if the module already reports UTC, or the current leap
+/// second count (18 since 2017) if it reports GPS time.
+void gps_clock_init(gpsclock* clock, int leap_seconds);
+
+/// \brief Converts the GPS week number and time of week into UTC date/time components using the cached date.
+/// \param clock converter state, see gps_clock_init()
+/// \param detail The speed, altitude, course and date/time registers from the GPS sensor data
+/// \param broken Receives the date/time components, see time_to_tm()
+/// \returns zero on success
+int gps_clock_convert(gpsclock* clock, const GPS_DETAIL* detail, struct tm* broken);
+
 /// \brief Formats a NMEA GPGGA sentence from GPS sensor data.
 /// \param sout The output buffer that will receive the NMEA sentence
-/// \param sout_length The capacity of the output buffer for safety, typically use strlen(sout) when calling this function.
+/// \param sout_length The capacity of the output buffer including the nul terminator, typically sizeof(sout). The
+/// formatter never writes past this length.
 /// \param status The status register from the GPS sensor data
 /// \param location The lat/lon registers from the GPS sensor data
 /// \param detail The speed, altitude, course and date/time registers from the GPS sensor data
+/// \returns the length of the sentence excluding the nul terminator, or -ENOSPC if sout_length was too small
 int nmea_gga(char* sout, int sout_length, STATUS_REGISTER* status, GPS_COORDINATES* location, GPS_DETAIL* detail);
 
+/// \brief Formats a NMEA GPGGA sentence using date/time components that were already converted.
+/// Same as nmea_gga() but avoids converting the time again when a gpsclock or a prior conversion is available.
+/// \param broken The UTC date/time of the fix, see gps_clock_convert()
+int nmea_gga_tm(char* sout, int sout_length, const STATUS_REGISTER* status, const GPS_COORDINATES* location,
+                const GPS_DETAIL* detail, const struct tm* broken);
+
 /// \brief Formats a NMEA GPZDA sentence providing UTC date and time.
 /// \param sout The output buffer that will receive the NMEA sentence
-/// \param sout_length The capacity of the output buffer for safety, typically use strlen(sout) when calling this function.
+/// \param sout_length The capacity of the output buffer including the nul terminator, typically sizeof(sout). The
+/// formatter never writes past this length.
 /// \param detail The speed, altitude, course and date/time registers from the GPS sensor data
+/// \returns the length of the sentence excluding the nul terminator, or -ENOSPC if sout_length was too small
 int nmea_zda(char* sout, int sout_length, GPS_DETAIL* detail);
 
+/// \brief Formats a NMEA GPZDA sentence using date/time components that were already converted.
+/// \param broken The UTC date/time of the fix, see gps_clock_convert()
+int nmea_zda_tm(char* sout, int sout_length, const GPS_DETAIL* detail, const struct tm* broken);
+
+/// \brief Formats a NMEA GPRMC sentence with position, speed over ground in knots, course and date.
+/// \param broken The UTC date/time of the fix, see gps_clock_convert()
+/// \returns the length of the sentence excluding the nul terminator, or -ENOSPC if sout_length was too small
+int nmea_rmc_tm(char* sout, int sout_length, const STATUS_REGISTER* status, const GPS_COORDINATES* location,
+                const GPS_DETAIL* detail, const struct tm* broken);
+
+/// \brief Formats a NMEA GPVTG sentence with course and speed over ground in knots and km/h.
+/// The mode indicator follows the fix state like RMC, N without a fix.
+int nmea_vtg(char* sout, int sout_length, const STATUS_REGISTER* status, const GPS_DETAIL* detail);
+
+/// \brief Formats a NMEA GPGSA sentence with the fix type, the satellite and DOP fields are left empty.
+int nmea_gsa(char* sout, int sout_length, const STATUS_REGISTER* status);
+
+/// Sentence selection bits for nmea_sentences(), sentences are output in this order
+#define NMEA_ZDA        0x01
+#define NMEA_GGA        0x02
+#define NMEA_RMC        0x04
+#define NMEA_VTG        0x08
+#define NMEA_GSA        0x10
+#define NMEA_ALL        0x1f
+#define NMEA_DEFAULT    (NMEA_ZDA|NMEA_GGA)
+
+/// Sentences that carry a position or velocity, without a fix they go out with empty fields flagged as invalid
+#define NMEA_FIX_DATA   (NMEA_GGA|NMEA_RMC|NMEA_VTG)
+
+/// \brief One decoded module update with its time already converted, shared by all sentences of the epoch.
+typedef struct _nmea_epoch {
+    STATUS_REGISTER status;
+    GPS_COORDINATES location;
+    GPS_DETAIL detail;
+    struct tm broken;       // UTC date/time, see gps_clock_convert()
+    int estimated;          // non-zero if the position was extrapolated, GGA fix quality 6 and mode E in RMC/VTG
+} nmea_epoch;
+
+/// \brief Formats the sentences selected by mask back to back into sout.
+/// \returns the total length excluding the nul terminator, or -ENOSPC if sout_length was too small for all of them
+int nmea_sentences(char* sout, int sout_length, unsigned int mask, const nmea_epoch* epoch);
+
 
 #endif // __QUADRINO_GPS_NMEA_H
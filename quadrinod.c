@@ -0,0 +1,419 @@
+// Userspace driver for the Quadrino GPS through i2c-dev
+// usage: ./gps_quadrinod [-d i2c device] [-a address] [-p poll msecs] [-s socket] [-t pty link] [-m sentences]
+//                        [-l leap seconds] [-v]
+//
+// For systems where the kernel module can't be loaded. The registers are polled through /dev/i2c-N with I2C_RDWR
+// combined transactions, the register address write and the read share one transfer with a repeated start so no
+// other master can move the register pointer in between. Scheduling, epoch dedupe, decoding and formatting are the
+// gpscore.c pipeline the kernel driver runs, so both modes poll and format identically.
+//
+// The sentences are served on a pty, applications open the slave through the -t symlink like they would the
+// driver's /dev/ttyGPS0, and on a Unix stream socket for any number of clients. Output never blocks the poll loop,
+// a pty nobody reads is flushed so it restarts at the latest batch and a socket client that can't take a whole batch
+// is disconnected. Everything runs from one epoll loop, a timerfd paces the polls and a signalfd handles shutdown.
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "gpscore.h"
+
+#define DEFAULT_DEVICE      "/dev/i2c-1"
+#define DEFAULT_ADDRESS     0x20
+#define DEFAULT_POLL        25
+#define DEFAULT_SOCKET      "/run/quadrinod.sock"
+#define DEFAULT_PTY         "/dev/ttyGPSd0"
+
+#define MAX_CLIENTS         16
+#define MAX_EVENTS          (MAX_CLIENTS + 4)
+#define OUTPUT_SIZE         512
+
+// epoll tags for the fixed descriptors, clients are tagged with their slot
+#define TAG_TIMER           (MAX_CLIENTS + 0)
+#define TAG_SIGNAL          (MAX_CLIENTS + 1)
+#define TAG_LISTEN          (MAX_CLIENTS + 2)
+
+typedef struct {
+    int i2c;
+    uint16_t address;
+    int epoll;
+    int timer;
+    int signal;
+    int listen;
+    int pty;                        // master side, -1 if the pty is disabled
+    int pty_slave;                  // held open so the master never sees a hangup
+    int clients[MAX_CLIENTS];
+
+    gpscore_sched sched;
+    gpscore_epoch last_epoch;
+    gpsclock clock;
+    unsigned int sentences;
+    char output[OUTPUT_SIZE];
+
+    // counters, printed on exit with -v
+    unsigned long cycles, updates, duplicates, failures, bytes, pty_flushed, dropped_clients;
+} quadrinod;
+
+static int verbose;
+
+/// \brief Converts seconds since epoch to broken out date/time components
+/// The kernel contains this function but it is not available in user-space. NMEA time is UTC so we don't apply the
+/// local timezone.
+void time_to_tm(time_t totalsecs, int offset, struct tm *result)
+{
+    totalsecs += offset;
+    gmtime_r(&totalsecs, result);
+}
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// \brief Reads len registers starting at reg in one combined transaction.
+static int i2c_read_registers(quadrinod* d, uint8_t reg, void* data, uint16_t len)
+{
+    struct i2c_msg msgs[2];
+    struct i2c_rdwr_ioctl_data xfer;
+
+    msgs[0].addr = d->address;
+    msgs[0].flags = 0;
+    msgs[0].len = 1;
+    msgs[0].buf = &reg;
+    msgs[1].addr = d->address;
+    msgs[1].flags = I2C_M_RD;
+    msgs[1].len = len;
+    msgs[1].buf = (uint8_t*)data;
+    xfer.msgs = msgs;
+    xfer.nmsgs = 2;
+
+    if(ioctl(d->i2c, I2C_RDWR, &xfer) != 2)
+        return -1;
+    return 0;
+}
+
+static void set_nonblock(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int watch(quadrinod* d, int fd, uint64_t tag)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = tag;
+    return epoll_ctl(d->epoll, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void arm_timer(quadrinod* d, uint32_t usecs)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    // a zero it_value would disarm the timer
+    its.it_value.tv_sec = usecs / 1000000;
+    its.it_value.tv_nsec = (usecs % 1000000) * 1000 + 1;
+    timerfd_settime(d->timer, 0, &its, NULL);
+}
+
+static void drop_client(quadrinod* d, int slot)
+{
+    epoll_ctl(d->epoll, EPOLL_CTL_DEL, d->clients[slot], NULL);
+    close(d->clients[slot]);
+    d->clients[slot] = -1;
+}
+
+/// \brief Hands one batch to the pty and every socket client, none of them may stall the poll loop.
+static void publish(quadrinod* d, const char* out, int size)
+{
+    ssize_t n;
+    int i;
+
+    d->bytes += size;
+    if(d->pty >= 0) {
+        n = write(d->pty, out, size);
+        if(n < 0 && errno == EAGAIN) {
+            // nobody is reading the pty, discard the backlog so a new reader starts with current sentences
+            tcflush(d->pty_slave, TCIFLUSH);
+            d->pty_flushed++;
+            (void)write(d->pty, out, size);
+        }
+    }
+
+    for(i=0; i<MAX_CLIENTS; i++) {
+        if(d->clients[i] < 0)
+            continue;
+        // a partial batch would leave a broken sentence in the client's stream, a slow client is let go instead
+        n = send(d->clients[i], out, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n != size) {
+            drop_client(d, i);
+            d->dropped_clients++;
+        }
+    }
+}
+
+/// \brief Runs one poll cycle and returns the delay in usecs until the next one.
+static uint32_t poll_cycle(quadrinod* d)
+{
+    GPS_REGISTERS regs;
+    STATUS_REGISTER status;
+    nmea_epoch epoch;
+    int len;
+
+    d->cycles++;
+
+    // in adaptive mode only the status register is read until the module flags a new update
+    if(d->sched.poll_interval) {
+        if(i2c_read_registers(d, I2C_GPS_STATUS_00, &status, 1) < 0) {
+            d->failures++;
+            goto end;
+        }
+        if(!status.new_data)
+            goto end;
+        gpscore_sched_learn(&d->sched, monotonic_ns());
+    }
+
+    if(i2c_read_registers(d, I2C_GPS_STATUS_00, &regs, sizeof(regs)) < 0) {
+        d->failures++;
+        goto end;
+    }
+    d->updates++;
+    gpscore_decode(&regs, &epoch);
+    if(!gpscore_epoch_new(&d->last_epoch, epoch.status, &epoch.detail)) {
+        d->duplicates++;
+        goto end;
+    }
+
+    len = gpscore_format(d->output, sizeof(d->output), d->sentences, &d->clock, &epoch);
+    if(len > 0)
+        publish(d, d->output, len);
+
+end:
+    return gpscore_sched_next(&d->sched, monotonic_ns());
+}
+
+static void accept_client(quadrinod* d)
+{
+    int fd, i;
+
+    fd = accept4(d->listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd < 0)
+        return;
+    for(i=0; i<MAX_CLIENTS; i++) {
+        if(d->clients[i] < 0)
+            break;
+    }
+    if(i == MAX_CLIENTS || watch(d, fd, i) < 0) {
+        close(fd);
+        return;
+    }
+    d->clients[i] = fd;
+}
+
+static void client_input(quadrinod* d, int slot)
+{
+    char discard[64];
+    ssize_t n;
+
+    // clients only listen, anything they send is ignored until they hang up
+    n = read(d->clients[slot], discard, sizeof(discard));
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        drop_client(d, slot);
+}
+
+static int open_pty(quadrinod* d, const char* link)
+{
+    struct termios tio;
+    const char* name;
+
+    d->pty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if(d->pty < 0 || grantpt(d->pty) < 0 || unlockpt(d->pty) < 0 || (name = ptsname(d->pty)) == NULL) {
+        perror("pty");
+        return -1;
+    }
+    d->pty_slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if(d->pty_slave < 0) {
+        perror(name);
+        return -1;
+    }
+
+    // pass the sentences through untouched
+    tcgetattr(d->pty_slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(d->pty_slave, TCSANOW, &tio);
+
+    unlink(link);
+    if(symlink(name, link) < 0) {
+        perror(link);
+        return -1;
+    }
+    return 0;
+}
+
+static int open_socket(quadrinod* d, const char* path)
+{
+    struct sockaddr_un addr;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    unlink(path);
+    d->listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(d->listen < 0 || bind(d->listen, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(d->listen, 8) < 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-d device] [-a address] [-p msecs] [-s socket] [-t pty] [-m sentences] [-l leap] [-v]\n"
+                    "  -d device    i2c-dev device of the bus (default %s)\n"
+                    "  -a address   7bit I2C address of the module (default 0x%02x)\n"
+                    "  -p msecs     status poll interval, 0 reads everything every %d msecs (default %d)\n"
+                    "  -s socket    Unix socket path, empty disables (default %s)\n"
+                    "  -t pty       symlink to the pty slave, empty disables (default %s)\n"
+                    "  -m mask      NMEA_* mask of the sentences to output (default 0x%02x)\n"
+                    "  -l leap      GPS-UTC leap seconds, use 18 if the module reports GPS time (default 0)\n"
+                    "  -v           print counters on exit\n",
+            prog, DEFAULT_DEVICE, DEFAULT_ADDRESS, GPSCORE_READ_TIME, DEFAULT_POLL, DEFAULT_SOCKET, DEFAULT_PTY,
+            NMEA_DEFAULT);
+}
+
+int main(int argc, char** argv)
+{
+    const char* device = DEFAULT_DEVICE;
+    const char* socket_path = DEFAULT_SOCKET;
+    const char* pty_link = DEFAULT_PTY;
+    unsigned long poll_interval = DEFAULT_POLL;
+    int leap_seconds = 0;
+    struct epoll_event events[MAX_EVENTS];
+    struct signalfd_siginfo si;
+    uint64_t expirations;
+    sigset_t mask;
+    quadrinod d;
+    int opt, n, i, running = 1;
+
+    memset(&d, 0, sizeof(d));
+    d.address = DEFAULT_ADDRESS;
+    d.sentences = NMEA_DEFAULT;
+    d.pty = d.pty_slave = d.listen = -1;
+    for(i=0; i<MAX_CLIENTS; i++)
+        d.clients[i] = -1;
+
+    while((opt = getopt(argc, argv, "d:a:p:s:t:m:l:vh")) != -1) {
+        switch(opt) {
+            case 'd': device = optarg; break;
+            case 'a': d.address = (uint16_t)strtoul(optarg, NULL, 0); break;
+            case 'p': poll_interval = strtoul(optarg, NULL, 0); break;
+            case 's': socket_path = optarg; break;
+            case 't': pty_link = optarg; break;
+            case 'm': d.sentences = (unsigned int)strtoul(optarg, NULL, 0) & NMEA_ALL; break;
+            case 'l': leap_seconds = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if(poll_interval > GPSCORE_POLL_INTERVAL_MAX || d.address > 0x7f || (!*socket_path && !*pty_link)) {
+        usage(argv[0]);
+        return 2;
+    }
+    gpscore_sched_init(&d.sched, (uint32_t)poll_interval);
+    gps_clock_init(&d.clock, leap_seconds);
+
+    d.i2c = open(device, O_RDWR | O_CLOEXEC);
+    if(d.i2c < 0) {
+        perror(device);
+        return 1;
+    }
+
+    // the signals arrive through the event loop so shutdown can clean up the socket and link
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    d.epoll = epoll_create1(EPOLL_CLOEXEC);
+    d.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    d.signal = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(d.epoll < 0 || d.timer < 0 || d.signal < 0) {
+        perror("event loop");
+        return 1;
+    }
+    if((*pty_link && open_pty(&d, pty_link) < 0) || (*socket_path && open_socket(&d, socket_path) < 0))
+        return 1;
+    if(d.pty >= 0)
+        set_nonblock(d.pty);
+
+    watch(&d, d.timer, TAG_TIMER);
+    watch(&d, d.signal, TAG_SIGNAL);
+    if(d.listen >= 0)
+        watch(&d, d.listen, TAG_LISTEN);
+
+    arm_timer(&d, 0);
+    while(running) {
+        n = epoll_wait(d.epoll, events, MAX_EVENTS, -1);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        for(i=0; i<n; i++) {
+            switch(events[i].data.u64) {
+                case TAG_TIMER:
+                    if(read(d.timer, &expirations, sizeof(expirations)) > 0)
+                        arm_timer(&d, poll_cycle(&d));
+                    break;
+                case TAG_SIGNAL:
+                    if(read(d.signal, &si, sizeof(si)) == sizeof(si))
+                        running = 0;
+                    break;
+                case TAG_LISTEN:
+                    accept_client(&d);
+                    break;
+                default:
+                    if(d.clients[events[i].data.u64] >= 0)
+                        client_input(&d, (int)events[i].data.u64);
+                    break;
+            }
+        }
+    }
+
+    if(*socket_path)
+        unlink(socket_path);
+    if(*pty_link)
+        unlink(pty_link);
+    if(verbose)
+        fprintf(stderr, "cycles: %lu\nupdates: %lu\nduplicates: %lu\nfailures: %lu\nbytes: %lu\npty_flushed: %lu\n"
+                        "dropped_clients: %lu\n", d.cycles, d.updates, d.duplicates, d.failures, d.bytes,
+                d.pty_flushed, d.dropped_clients);
+    return 0;
+}
@@ -3,6 +3,7 @@
 
 #if !defined( __KERNEL__ )
 #include <stdint.h>
+#include <string.h>
 #else
 #include <linux/types.h>
 typedef u8  uint8_t;
@@ -152,8 +153,64 @@ typedef struct {
 #define I2C_GPS_WP13                            206
 #define I2C_GPS_WP14                            217
 #define I2C_GPS_WP15                            228
+        #define I2C_GPS_WP_SIZE               11       // bytes per waypoint, lat/lon int32_t, alt int16_t, flags uint8_t
+
+#define I2C_GPS_CONFIG_SIZE                         (I2C_GPS_NAV_IMAX - I2C_GPS_CROSSTRACK_GAIN + 1)   // writeable config window, no waypoints
+#define I2C_GPS_MAX_REGISTER                        (I2C_GPS_WP15 + I2C_GPS_WP_SIZE - 1)
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // End register definition 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
+
+// Image of the read-only register window, I2C_GPS_STATUS_00 through the end of I2C_GPS_TIME. Reading the whole
+// window in one transaction is cheaper than separate reads and guarantees every value comes from the same module
+// update. Members are unaligned, use the accessors below rather than taking their address.
+#define I2C_GPS_REGISTERS_SIZE                      43
+
+typedef struct __attribute__((packed)) {
+    STATUS_REGISTER   status;                   // 00
+    COMMAND_REGISTER  command;                  // 01
+    WAYPOINT_REGISTER waypoint;                 // 02
+    uint8_t           version;                  // 03
+    uint8_t           reserved[3];              // 04..06
+    GPS_COORDINATES   location;                 // 07
+    int16_t           nav_lat;                  // 15
+    int16_t           nav_lon;                  // 17
+    uint32_t          wp_distance;              // 19
+    int16_t           wp_target_bearing;        // 23
+    int16_t           nav_bearing;              // 25
+    int16_t           home_to_copter_bearing;   // 27
+    int16_t           distance_to_home;         // 29
+    GPS_DETAIL        detail;                   // 31
+} GPS_REGISTERS;
+
+// fails to compile if the image does not match the register map
+typedef char GPS_REGISTERS_size_check[(sizeof(GPS_REGISTERS) == I2C_GPS_REGISTERS_SIZE) ? 1 : -1];
+
+// One waypoint slot, waypoint n lives at I2C_GPS_WP0 + n * I2C_GPS_WP_SIZE
+#define I2C_GPS_WP_COUNT                            16
+
+typedef struct __attribute__((packed)) {
+    GPS_COORDINATES   position;                 // degree*10 000 000
+    int16_t           altitude;                 // meters
+    uint8_t           flags;
+} GPS_WAYPOINT;
+
+typedef char GPS_WAYPOINT_size_check[(sizeof(GPS_WAYPOINT) == I2C_GPS_WP_SIZE) ? 1 : -1];
+
+static inline STATUS_REGISTER gps_registers_status(const GPS_REGISTERS* regs)
+{
+    return regs->status;
+}
+
+static inline void gps_registers_location(const GPS_REGISTERS* regs, GPS_COORDINATES* location)
+{
+    memcpy(location, (const uint8_t*)regs + I2C_GPS_LOCATION, sizeof(GPS_COORDINATES));
+}
+
+static inline void gps_registers_detail(const GPS_REGISTERS* regs, GPS_DETAIL* detail)
+{
+    memcpy(detail, (const uint8_t*)regs + I2C_GPS_GROUND_SPEED, sizeof(GPS_DETAIL));
+}
+
 #endif // __QUADRINO_GPS_REGISTERS_H
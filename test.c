@@ -8,9 +8,15 @@
 #include <stdint.h>
 //#include <sys/time.h>
 #include <time.h>
+#include <math.h>
 #include <memory.h>
+#include <string.h>
+#include <errno.h>
 
 #include "nmea.h"
+#include "binrec.h"
+#include "deadreck.h"
+#include "gpscore.h"
 
 typedef struct {
     STATUS_REGISTER status;
@@ -85,6 +91,47 @@ int main()
     if(dms.fraction !=40734) printf("FRAK!=%d  ", 40734);
     printf("\n");
 
+    // the incremental clock converter must agree with the full conversion, sweep 10Hz fixes across midnight and
+    // then jump around to force day rollovers and discontinuities
+    {
+        gpsclock clock;
+        GPS_DETAIL d = sample[0].detail;
+        struct tm full, incr;
+        int i, failures = 0;
+
+        gps_clock_init(&clock, 0);
+        d.time = 8640000 - 6000;
+        for(i=0; i<20000 && failures<5; i++) {
+            if(i%1000 == 999)
+                d.time += 7*360000;                      // jump forward hours at a time, crossing days
+            else
+                d.time += 10;
+            if(d.time >= 7*8640000) {
+                d.time -= 7*8640000;
+                d.week++;
+            }
+            gps_time2tm(&d, &full);
+            gps_clock_convert(&clock, &d, &incr);
+            if(full.tm_sec!=incr.tm_sec || full.tm_min!=incr.tm_min || full.tm_hour!=incr.tm_hour ||
+               full.tm_mday!=incr.tm_mday || full.tm_mon!=incr.tm_mon || full.tm_year!=incr.tm_year) {
+                printf("FAILED   CLOCK  week %d time %u => %02d:%02d:%02d != %02d:%02d:%02d\n", d.week, d.time,
+                       incr.tm_hour, incr.tm_min, incr.tm_sec, full.tm_hour, full.tm_min, full.tm_sec);
+                failures++;
+            }
+        }
+
+        // leap seconds move the start of the week back into the previous week
+        gps_clock_init(&clock, 18);
+        d.time = 0;
+        gps_clock_convert(&clock, &d, &incr);
+        d.week--;
+        d.time = 7*8640000 - 1800;
+        gps_time2tm(&d, &full);
+        if(full.tm_mday!=incr.tm_mday || full.tm_hour!=incr.tm_hour || full.tm_min!=incr.tm_min || full.tm_sec!=incr.tm_sec)
+            printf("FAILED   LEAP  %02d:%02d:%02d != %02d:%02d:%02d\n",
+                   incr.tm_hour, incr.tm_min, incr.tm_sec, full.tm_hour, full.tm_min, full.tm_sec);
+    }
+
     // output sample GPGAA sentences
     gpsdata* pdata = sample; 
     while(pdata->location.lat!=0) {
@@ -95,6 +142,274 @@ int main()
         pdata++;
     }
 
+    // RMC and VTG speed and course, 10m/s is 19.4 knots and 36.0 km/h
+    {
+        nmea_epoch epoch = { sample[0].status, sample[0].location, sample[0].detail };
+        epoch.detail.ground_speed = 1000;
+        epoch.detail.ground_course = 1234;
+        gps_time2tm(&epoch.detail, &epoch.broken);
+        nmea_vtg(sout, sizeof(sout), &epoch.status, &epoch.detail);
+        if(strncmp(sout, "$GPVTG,123.4,T,,M,19.4,N,36.0,K,A*", 34) != 0)
+            printf("FAILED   VTG  %s", sout);
+        {
+            STATUS_REGISTER nofix = epoch.status;
+            nofix.gps2dfix = nofix.gps3dfix = 0;
+            nmea_vtg(sout, sizeof(sout), &nofix, &epoch.detail);
+            if(strncmp(sout, "$GPVTG,,T,,M,,N,,K,N*", 21) != 0)
+                printf("FAILED   VTG  no fix %s", sout);
+            nmea_rmc_tm(sout, sizeof(sout), &nofix, &epoch.location, &epoch.detail, &epoch.broken);
+            if(strstr(sout, ",V,,,,,,,") == NULL || strstr(sout, ",,,N*") == NULL)
+                printf("FAILED   RMC  no fix %s", sout);
+            nmea_gga_tm(sout, sizeof(sout), &nofix, &epoch.location, &epoch.detail, &epoch.broken);
+            if(strstr(sout, ",,,,,0,") == NULL || strstr(sout, ",,,M,,M,,,*") == NULL)
+                printf("FAILED   GGA  no fix %s", sout);
+        }
+        nmea_rmc_tm(sout, sizeof(sout), &epoch.status, &epoch.location, &epoch.detail, &epoch.broken);
+        if(strstr(sout, ",19.4,123.4,") == NULL)
+            printf("FAILED   RMC  %s", sout);
+
+        // the combined formatter must be the sentences back to back, in mask order
+        char each[512];
+        int len = nmea_zda_tm(each, sizeof(each), &epoch.detail, &epoch.broken);
+        len += nmea_gga_tm(each+len, sizeof(each)-len, &epoch.status, &epoch.location, &epoch.detail, &epoch.broken);
+        len += nmea_gsa(each+len, sizeof(each)-len, &epoch.status);
+        if(nmea_sentences(sout, sizeof(sout), NMEA_ZDA|NMEA_GGA|NMEA_GSA, &epoch) != len || strcmp(sout, each) != 0)
+            printf("FAILED   SENTENCES  %s", sout);
+        if(nmea_sentences(sout, 40, NMEA_ALL, &epoch) != -ENOSPC)
+            printf("FAILED   SENTENCES  overflow not detected\n");
+    }
+
+    // binary records must survive the round trip and any damage must be detected
+    {
+        struct quadrino_gps_fix_record in, out;
+        uint8_t rec[QUADRINO_GPS_BINREC_SIZE * 2];
+        int i, bit, len, failures = 0;
+
+        if(binrec_crc16((const uint8_t*)"123456789", 9, 0xffff) != 0x29b1)
+            printf("FAILED   BINREC  crc %04x != 29b1\n", binrec_crc16((const uint8_t*)"123456789", 9, 0xffff));
+
+        for(pdata = sample; pdata->location.lat!=0; pdata++) {
+            memset(&in, 0, sizeof(in));
+            in.seq = 0x80000001u + (uint32_t)(pdata - sample);
+            in.timestamp_ns = -1234567890123456789LL;
+            in.location = pdata->location;
+            in.detail = pdata->detail;
+            in.status = pdata->status;
+            in.flags = (pdata - sample) & 1 ? QUADRINO_GPS_FIX_ESTIMATED : 0;
+            len = binrec_encode(rec, sizeof(rec), &in);
+            if(len != QUADRINO_GPS_BINREC_SIZE || binrec_decode(rec, len, &out) != len ||
+               memcmp(&in, &out, sizeof(in)) != 0) {
+                printf("FAILED   BINREC  round trip of sample %d\n", (int)(pdata - sample));
+                continue;
+            }
+
+            // every single bit error is caught by the CRC, the sync word or the version/size check
+            for(i = 0; i < len && failures < 5; i++) {
+                for(bit = 0; bit < 8; bit++) {
+                    rec[i] ^= (uint8_t)(1 << bit);
+                    if(binrec_decode(rec, len, &out) >= 0) {
+                        printf("FAILED   BINREC  bit %d of byte %d flipped but decoded\n", bit, i);
+                        failures++;
+                    }
+                    rec[i] ^= (uint8_t)(1 << bit);
+                }
+            }
+        }
+
+        if(binrec_encode(rec, QUADRINO_GPS_BINREC_SIZE - 1, &in) != -ENOSPC)
+            printf("FAILED   BINREC  short output buffer\n");
+        binrec_encode(rec, sizeof(rec), &in);
+        if(binrec_decode(rec, QUADRINO_GPS_BINREC_SIZE - 1, &out) != -EAGAIN)
+            printf("FAILED   BINREC  partial record\n");
+        rec[2]++;
+        if(binrec_decode(rec, QUADRINO_GPS_BINREC_SIZE, &out) != -EPROTONOSUPPORT)
+            printf("FAILED   BINREC  unknown version\n");
+
+        // a reader joining mid stream skips the partial record and locks onto the next one
+        binrec_encode(rec, sizeof(rec), &in);
+        binrec_encode(rec + QUADRINO_GPS_BINREC_SIZE, QUADRINO_GPS_BINREC_SIZE, &in);
+        i = 7;
+        while(i < (int)sizeof(rec) && binrec_decode(rec + i, sizeof(rec) - i, &out) < 0)
+            i += binrec_resync(rec + i, sizeof(rec) - i);
+        if(i != QUADRINO_GPS_BINREC_SIZE)
+            printf("FAILED   BINREC  resync at %d\n", i);
+    }
+
+    // dead reckoning must follow a straight track from every sample fix and a spread of latitudes, within 2cm plus
+    // 0.1% of the distance travelled, at any course and speed up to the maximum horizon
+    {
+        static const int32_t lats[] = { -850000000, -600000000, -1000, 0, 12345678, 481173000, 750000000 };
+        static const uint16_t speeds[] = { 1, 50, 1500, 4000, 30000, 65535 };
+        static const uint32_t dts[] = { 0, 20, 33, 100, 500, 1000, 2500, DEADRECK_MAX_HORIZON };
+        GPS_COORDINATES from, to;
+        GPS_DETAIL d, out;
+        int t, nstarts = sizeof(lats)/sizeof(lats[0]), failures = 0;
+        unsigned int si, ti;
+        uint32_t course;
+        double worst = 0;
+
+        for(pdata = sample; pdata->location.lat!=0; pdata++)
+            nstarts++;
+        for(t = 0; t < nstarts && failures < 5; t++) {
+            if(t < (int)(sizeof(lats)/sizeof(lats[0]))) {
+                from.lat = lats[t];
+                from.lon = 1799990000 - t*510000000;
+                d = sample[0].detail;
+            } else {
+                from = sample[t - sizeof(lats)/sizeof(lats[0])].location;
+                d = sample[t - sizeof(lats)/sizeof(lats[0])].detail;
+            }
+            for(course = 0; course < 3600 && failures < 5; course += 37) {
+                for(si = 0; si < sizeof(speeds)/sizeof(speeds[0]); si++) {
+                    for(ti = 0; ti < sizeof(dts)/sizeof(dts[0]); ti++) {
+                        double dist, north, east, coslat, elat, elon, err;
+                        d.ground_speed = speeds[si];
+                        d.ground_course = (uint16_t)course;
+                        if(deadreck_predict(&from, &d, dts[ti], &to, &out) != 0) {
+                            printf("FAILED   DEADRECK  dt %u rejected\n", dts[ti]);
+                            failures++;
+                            continue;
+                        }
+                        dist = speeds[si] * (dts[ti] / 1000.0);                         // cm
+                        north = dist * cos(course / 10.0 * M_PI / 180);
+                        east = dist * sin(course / 10.0 * M_PI / 180);
+                        coslat = cos(from.lat / 1e7 * M_PI / 180);
+                        elat = (to.lat - (from.lat + north * 1e7 / 11131949.0)) * 1.1131949;
+                        elon = (double)to.lon - from.lon - east * 1e7 / (11131949.0 * coslat);
+                        elon = fmod(elon + 3600000000.0 + 1800000000.0, 3600000000.0) - 1800000000.0;
+                        elon *= 1.1131949 * coslat;
+                        err = sqrt(elat*elat + elon*elon);
+                        if(err > worst)
+                            worst = err;
+                        if(err > 2.0 + dist / 1000) {
+                            printf("FAILED   DEADRECK  lat %d course %u speed %u dt %u off by %.1fcm\n",
+                                   from.lat, course, speeds[si], dts[ti], err);
+                            failures++;
+                        }
+                        if(out.time != (d.time + (dts[ti] + 5) / 10) % (7*8640000) || out.altitude != d.altitude)
+                            printf("FAILED   DEADRECK  time %u after %ums\n", out.time, dts[ti]);
+                    }
+                }
+            }
+        }
+        printf("dead reckoning worst error %.2fcm\n", worst);
+
+        if(deadreck_predict(&from, &d, DEADRECK_MAX_HORIZON + 1, &to, &out) != -ERANGE)
+            printf("FAILED   DEADRECK  horizon not enforced\n");
+
+        // the time of week rolls over into the next week
+        d.week = 1900;
+        d.time = 7*8640000 - 3;
+        deadreck_predict(&from, &d, 50, &to, &out);
+        if(out.week != 1901 || out.time != 2)
+            printf("FAILED   DEADRECK  week rollover %u %u\n", out.week, out.time);
+
+        // estimated epochs are flagged in GGA, RMC and VTG
+        {
+            nmea_epoch epoch = { sample[0].status, sample[0].location, sample[0].detail };
+            gps_time2tm(&epoch.detail, &epoch.broken);
+            epoch.estimated = 1;
+            nmea_sentences(sout, sizeof(sout), NMEA_GGA|NMEA_RMC|NMEA_VTG, &epoch);
+            if(!strstr(sout, "W,6,") || !strstr(sout, ",,,E*") || !strstr(sout, ",K,E*"))
+                printf("FAILED   DEADRECK  estimated sentences %s", sout);
+        }
+    }
+
+    // shared read pipeline, the scheduler sleeps until shortly before the learned update and dedupes by GPS time
+    {
+        gpscore_sched sched;
+        gpscore_epoch last = { 0 };
+        nmea_epoch epoch = { sample[0].status };
+        int64_t ms = 1000000;
+        int i;
+
+        gpscore_sched_init(&sched, 25);
+        if(gpscore_sched_next(&sched, 0) != 25000)
+            printf("FAILED   GPSCORE  unlearned poll %u\n", gpscore_sched_next(&sched, 0));
+        for(i=1; i<=5; i++)
+            gpscore_sched_learn(&sched, i*200*ms);
+        if(sched.update_period != 200 || gpscore_sched_next(&sched, 1010*ms) != 165000)
+            printf("FAILED   GPSCORE  period %u next %u\n", sched.update_period, gpscore_sched_next(&sched, 1010*ms));
+        if(gpscore_sched_next(&sched, 1180*ms) != 25000)
+            printf("FAILED   GPSCORE  guard poll %u\n", gpscore_sched_next(&sched, 1180*ms));
+        gpscore_sched_learn(&sched, 6000*ms);
+        if(sched.update_period != 0)
+            printf("FAILED   GPSCORE  discontinuity kept period %u\n", sched.update_period);
+        gpscore_sched_init(&sched, 0);
+        if(gpscore_sched_next(&sched, 0) != GPSCORE_READ_TIME*1000)
+            printf("FAILED   GPSCORE  fixed rate poll\n");
+
+        epoch.status.new_data = 1;
+        epoch.detail = sample[0].detail;
+        if(!gpscore_epoch_new(&last, epoch.status, &epoch.detail))
+            printf("FAILED   GPSCORE  first epoch\n");
+        epoch.status.new_data = 0;
+        if(gpscore_epoch_new(&last, epoch.status, &epoch.detail))
+            printf("FAILED   GPSCORE  duplicate epoch\n");
+        epoch.detail.time += 10;
+        if(!gpscore_epoch_new(&last, epoch.status, &epoch.detail))
+            printf("FAILED   GPSCORE  next epoch\n");
+
+        epoch.status.gps2dfix = epoch.status.gps3dfix = 0;
+        if(gpscore_sentences(NMEA_ALL, &epoch) != NMEA_ALL)
+            printf("FAILED   GPSCORE  no fix mask %02x\n", gpscore_sentences(NMEA_ALL, &epoch));
+        epoch.detail.week = 0;
+        if(gpscore_sentences(NMEA_ALL, &epoch) != NMEA_GSA)
+            printf("FAILED   GPSCORE  no time mask %02x\n", gpscore_sentences(NMEA_ALL, &epoch));
+    }
+
+    // time transfer, the offset follows the least delayed read of every window and steps on large jumps
+    {
+        gpscore_timesync sync;
+        STATUS_REGISTER status = sample[0].status;
+        GPS_DETAIL detail = { 0, 0, 0, 1900, 12345 };
+        int64_t ms = 1000000, base = 1000*ms, utc, expect;
+        int i;
+
+        utc = gpscore_utc_ns(&detail, 0);
+        if(utc != (315964800LL + 1900LL*604800 + 123)*1000000000LL + 450*ms)
+            printf("FAILED   GPSCORE  utc %lld\n", (long long)utc);
+        if(gpscore_utc_ns(&detail, 18) != utc - 18000*ms)
+            printf("FAILED   GPSCORE  utc leap seconds\n");
+
+        gpscore_timesync_init(&sync, 0);
+        status.gps2dfix = status.gps3dfix = 0;
+        if(gpscore_timesync_sample(&sync, status, &detail, base) != -1 || sync.valid)
+            printf("FAILED   GPSCORE  timesync without fix\n");
+        status.gps3dfix = 1;
+
+        // reads land 5..12ms after the fix, the first one sets the rough offset
+        if(gpscore_timesync_sample(&sync, status, &detail, base + 12*ms) != 1 || sync.offset != utc - base - 12*ms)
+            printf("FAILED   GPSCORE  timesync first offset %lld\n", (long long)sync.offset);
+        for(i=1; i<=GPSCORE_TIMESYNC_WINDOW; i++) {
+            detail.time += 20;
+            if(gpscore_timesync_sample(&sync, status, &detail, base + i*200*ms + ((i == 3) ? 5 : 9)*ms) !=
+                    (i == GPSCORE_TIMESYNC_WINDOW))
+                printf("FAILED   GPSCORE  timesync window sample %d\n", i);
+        }
+        expect = utc - base - 12*ms + (7*ms)/4;
+        if(sync.offset != expect || sync.steps)
+            printf("FAILED   GPSCORE  timesync filtered %lld expected %lld\n", (long long)sync.offset, (long long)expect);
+
+        // a second jump of the module time steps the offset in one window
+        for(i=1; i<=GPSCORE_TIMESYNC_WINDOW; i++) {
+            detail.time += 20;
+            gpscore_timesync_sample(&sync, status, &detail, base - 1000*ms + (i+8)*200*ms + 5*ms);
+        }
+        if(sync.offset != utc - base + 1000*ms - 5*ms || sync.steps != 1 || sync.samples != 17)
+            printf("FAILED   GPSCORE  timesync step %lld steps %u\n", (long long)sync.offset, sync.steps);
+    }
+
+    // output sample GPRMC, GPVTG and GPGSA sentences
+    pdata = sample;
+    while(pdata->location.lat!=0) {
+        nmea_epoch epoch = { pdata->status, pdata->location, pdata->detail };
+        gps_time2tm(&pdata->detail, &epoch.broken);
+        if(nmea_sentences(sout, sizeof(sout), NMEA_RMC|NMEA_VTG|NMEA_GSA, &epoch) > 0)
+            printf("%s", sout);
+        pdata++;
+    }
+
     return 0;
 }
 